@@ -30,7 +30,9 @@
 #define UVC_CTRL_DATA_MAX	3
 #define UVC_CTRL_DATA_RES	4
 #define UVC_CTRL_DATA_DEF	5
-#define UVC_CTRL_DATA_LAST	6
+#define UVC_CTRL_DATA_PENDING	6
+#define UVC_CTRL_DATA_ASYNC	7
+#define UVC_CTRL_DATA_LAST	8
 
 /* ------------------------------------------------------------------------
  * Controls
@@ -839,6 +841,40 @@ static int uvc_entity_match_guid(const struct uvc_entity *entity,
     }
 }
 
+/* --------------------------------------------------------------------------
+ * Control lookup
+ *
+ * Controls are hashed by entity ID and selector when the device is
+ * initialized. Extension unit controls are hashed using the selector they
+ * will get when initialized (bmControls bit index + 1), but are only returned
+ * once initialized.
+ */
+
+static inline u32 uvc_ctrl_hash_key(__u8 entity_id, __u8 selector)
+{
+    return (entity_id << 8) | selector;
+}
+
+static inline __u8 uvc_ctrl_selector(const struct uvc_control *ctrl)
+{
+    return ctrl->initialized ? ctrl->info.selector : ctrl->index + 1;
+}
+
+struct uvc_control *uvc_ctrl_find(struct uvc_device *dev, __u8 entity_id,
+        __u8 selector)
+{
+    u32 key = uvc_ctrl_hash_key(entity_id, selector);
+    struct uvc_control *ctrl;
+
+    hash_for_each_possible(dev->ctrl_hash, ctrl, hash, key) {
+        if (ctrl->entity->id == entity_id &&
+                uvc_ctrl_selector(ctrl) == selector)
+            return ctrl->initialized ? ctrl : NULL;
+    }
+
+    return NULL;
+}
+
 /* --------------------------------------------------------------------------
  * Control transactions
  *
@@ -867,6 +903,244 @@ static int uvc_entity_match_guid(const struct uvc_entity *entity,
 
 
 
+/*
+ * Load the default value of a control. The default value is also needed to
+ * skip restoring controls that are back to it. It is loaded when a control
+ * is first written, so that uvc_ctrl_needs_restore() doesn't have to query
+ * the device at resume time.
+ */
+static int uvc_ctrl_load_def(struct uvc_device *dev, struct uvc_control *ctrl)
+{
+    int ret;
+
+    if (ctrl->def_loaded)
+        return 0;
+
+    if (!(ctrl->info.flags & UVC_CTRL_FLAG_GET_DEF))
+        return -EACCES;
+
+    ret = uvc_query_ctrl(dev, UVC_GET_DEF, ctrl->entity->id,
+            dev->intfnum, ctrl->info.selector,
+            uvc_ctrl_data(ctrl, UVC_CTRL_DATA_DEF),
+            ctrl->info.size);
+    if (ret < 0)
+        return ret;
+
+    ctrl->def_loaded = 1;
+    return 0;
+}
+
+/* --------------------------------------------------------------------------
+ * Asynchronous control writes
+ *
+ * Control loops such as software auto-exposure set the same control much
+ * faster than the device can acknowledge SET_CUR requests. uvc_ctrl_set_async
+ * stores the new value in the UVC_CTRL_DATA_PENDING slot and queues the
+ * control on the device async list without sleeping. The work handler then
+ * issues one SET_CUR request per queued control with the latest pending
+ * value, coalescing all writes received while the control was waiting.
+ *
+ * The pending value is snapshot to UVC_CTRL_DATA_ASYNC before the transfer so
+ * that callers can keep updating UVC_CTRL_DATA_PENDING while the request is in
+ * flight.
+ *
+ * The cached current value is protected by the chain control mutex. The work
+ * handler holds it from the moment it dequeues a control until the request
+ * completes and the cached value is updated, which serializes asynchronous
+ * writes with synchronous commits: a commit cancels the queued write of the
+ * controls it applies, and a write already dequeued has reached the device
+ * before the commit's own SET_CUR is sent.
+ */
+
+static void uvc_ctrl_async_work(struct work_struct *work)
+{
+    struct uvc_device *dev = container_of(work, struct uvc_device,
+            async_ctrl.work);
+    struct uvc_video_chain *chain;
+    struct uvc_control *ctrl;
+    unsigned long flags;
+    int ret;
+
+    while (1) {
+        spin_lock_irqsave(&dev->async_ctrl.lock, flags);
+        ctrl = list_first_entry_or_null(&dev->async_ctrl.pending,
+                struct uvc_control, async);
+        spin_unlock_irqrestore(&dev->async_ctrl.lock, flags);
+
+        if (ctrl == NULL)
+            break;
+
+        /* uvc_ctrl_set_async() only queues controls that belong to a
+         * chain.
+         */
+        chain = ctrl->chain;
+        mutex_lock(&chain->ctrl_mutex);
+
+        /* A commit may have cancelled the write while we were waiting for
+         * the mutex.
+         */
+        spin_lock_irqsave(&dev->async_ctrl.lock, flags);
+        if (!ctrl->async_queued) {
+            spin_unlock_irqrestore(&dev->async_ctrl.lock, flags);
+            mutex_unlock(&chain->ctrl_mutex);
+            continue;
+        }
+
+        list_del_init(&ctrl->async);
+        ctrl->async_queued = false;
+        memcpy(uvc_ctrl_data(ctrl, UVC_CTRL_DATA_ASYNC),
+                uvc_ctrl_data(ctrl, UVC_CTRL_DATA_PENDING),
+                ctrl->info.size);
+        spin_unlock_irqrestore(&dev->async_ctrl.lock, flags);
+
+        ret = uvc_query_ctrl(dev, UVC_SET_CUR, ctrl->entity->id,
+                dev->intfnum, ctrl->info.selector,
+                uvc_ctrl_data(ctrl, UVC_CTRL_DATA_ASYNC),
+                ctrl->info.size);
+
+        if (ret == 0) {
+            memcpy(uvc_ctrl_data(ctrl, UVC_CTRL_DATA_CURRENT),
+                    uvc_ctrl_data(ctrl, UVC_CTRL_DATA_ASYNC),
+                    ctrl->info.size);
+            uvc_ctrl_load_def(dev, ctrl);
+        }
+
+        spin_lock_irqsave(&dev->async_ctrl.lock, flags);
+        dev->async_ctrl.nsent++;
+
+        /* The cached current value can't be trusted anymore if the
+         * device rejected the request, force the next read to reload it.
+         */
+        if (ret < 0) {
+            dev->async_ctrl.nerrors++;
+            ctrl->async_failed = true;
+        } else {
+            ctrl->async_failed = false;
+            ctrl->async_written = true;
+        }
+        spin_unlock_irqrestore(&dev->async_ctrl.lock, flags);
+
+        mutex_unlock(&chain->ctrl_mutex);
+    }
+}
+
+/*
+ * Queue an asynchronous SET_CUR request for the control identified by its
+ * entity ID and selector. The function never sleeps and can be called from
+ * atomic context. Only the last value queued before the work handler picks up
+ * the control is written to the device.
+ *
+ * This is an in-kernel interface for control loops. The value is sent to the
+ * device as is, without being checked against the control limits.
+ */
+int uvc_ctrl_set_async(struct uvc_device *dev, __u8 entity_id, __u8 selector,
+        const void *data, __u16 size)
+{
+    struct uvc_control *ctrl;
+    unsigned long flags;
+
+    ctrl = uvc_ctrl_find(dev, entity_id, selector);
+    if (ctrl == NULL || ctrl->chain == NULL)
+        return -EINVAL;
+
+    if (!(ctrl->info.flags & UVC_CTRL_FLAG_SET_CUR))
+        return -EACCES;
+
+    if (size != ctrl->info.size)
+        return -EINVAL;
+
+    spin_lock_irqsave(&dev->async_ctrl.lock, flags);
+
+    memcpy(uvc_ctrl_data(ctrl, UVC_CTRL_DATA_PENDING), data, size);
+    dev->async_ctrl.nqueued++;
+
+    if (!ctrl->async_queued) {
+        list_add_tail(&ctrl->async, &dev->async_ctrl.pending);
+        ctrl->async_queued = true;
+    }
+
+    spin_unlock_irqrestore(&dev->async_ctrl.lock, flags);
+
+    schedule_work(&dev->async_ctrl.work);
+    return 0;
+}
+
+/*
+ * Drop the asynchronous write queued for a control. Must be called with the
+ * chain control mutex held, so that no write for the control is in flight.
+ */
+static void uvc_ctrl_cancel_async(struct uvc_device *dev,
+        struct uvc_control *ctrl)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&dev->async_ctrl.lock, flags);
+    if (ctrl->async_queued) {
+        list_del_init(&ctrl->async);
+        ctrl->async_queued = false;
+    }
+    ctrl->status_gen = 0;
+    spin_unlock_irqrestore(&dev->async_ctrl.lock, flags);
+}
+
+/*
+ * Copy the most recent value of a control: the value queued for an
+ * asynchronous write if any, the cached current value otherwise. Must be
+ * called with the chain control mutex held.
+ */
+static void uvc_ctrl_get_cur(struct uvc_device *dev, struct uvc_control *ctrl,
+        __u8 *data)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&dev->async_ctrl.lock, flags);
+    memcpy(data, uvc_ctrl_data(ctrl, ctrl->async_queued ?
+                UVC_CTRL_DATA_PENDING : UVC_CTRL_DATA_CURRENT),
+            ctrl->info.size);
+    spin_unlock_irqrestore(&dev->async_ctrl.lock, flags);
+}
+
+/*
+ * Update the cached current value of a control from a value change status
+ * event. Called from the status work handler. The value is trusted by
+ * uvc_ctrl_load_cur() until the status endpoint is stopped, as the device
+ * will report any further change. Values still queued for an asynchronous
+ * write are newer than the event and are left untouched.
+ */
+void uvc_ctrl_status_update(struct uvc_device *dev, struct uvc_control *ctrl,
+        const __u8 *data, int len)
+{
+    struct uvc_video_chain *chain;
+    unsigned long flags;
+
+    chain = ctrl->chain;
+    if (chain == NULL || len != ctrl->info.size)
+        return;
+
+    mutex_lock(&chain->ctrl_mutex);
+    spin_lock_irqsave(&dev->async_ctrl.lock, flags);
+    if (!ctrl->async_queued) {
+        memcpy(uvc_ctrl_data(ctrl, UVC_CTRL_DATA_CURRENT), data, len);
+        ctrl->status_gen = dev->async_ctrl.status_gen;
+    }
+    spin_unlock_irqrestore(&dev->async_ctrl.lock, flags);
+    mutex_unlock(&chain->ctrl_mutex);
+}
+
+/*
+ * Invalidate all values cached from status events. Called when the status
+ * endpoint is stopped and changes can't be reported anymore.
+ */
+void uvc_ctrl_status_invalidate(struct uvc_device *dev)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&dev->async_ctrl.lock, flags);
+    if (++dev->async_ctrl.status_gen == 0)
+        dev->async_ctrl.status_gen = 1;
+    spin_unlock_irqrestore(&dev->async_ctrl.lock, flags);
+}
+
 // complete
 static int uvc_ctrl_commit_entity(struct uvc_device *dev,
         struct uvc_entity *entity, int rollback)
@@ -896,6 +1170,19 @@ static int uvc_ctrl_commit_entity(struct uvc_device *dev,
         if (!ctrl->dirty)
             continue;
 
+        /* The synchronous commit carries the most recent value, drop any
+         * asynchronous write still queued for the control and wait for
+         * the device to report the value it actually applied.
+         */
+        uvc_ctrl_cancel_async(dev, ctrl);
+
+        if (!rollback)
+            ret = uvc_query_ctrl(dev, UVC_SET_CUR, ctrl->entity->id,
+                    dev->intfnum, ctrl->info.selector,
+                    uvc_ctrl_data(ctrl, UVC_CTRL_DATA_CURRENT),
+                    ctrl->info.size);
+        else
+            ret = 0;
 
         if (rollback || ret < 0)
             memcpy(uvc_ctrl_data(ctrl, UVC_CTRL_DATA_CURRENT),
@@ -906,52 +1193,457 @@ static int uvc_ctrl_commit_entity(struct uvc_device *dev,
 
         if (ret < 0)
             return ret;
+
+        if (!rollback) {
+            ctrl->modified = 1;
+            uvc_ctrl_load_def(dev, ctrl);
+        }
+    }
+
+    return 0;
+}
+
+/* --------------------------------------------------------------------------
+ * Control snapshot
+ *
+ * Monitoring applications poll many controls at a high rate. Reading them
+ * one by one costs a control transfer per value. The snapshot reads all
+ * controls of a chain in a single pass, querying the device only when the
+ * cached data can't be trusted:
+ *
+ * - GET_MIN, GET_MAX, GET_RES and GET_DEF results are static and cached for
+ *   the lifetime of the device the first time the control is visited.
+ * - GET_CUR results are cached until the value is changed, except for
+ *   auto-update controls that can change behind the driver's back.
+ */
+
+static int uvc_ctrl_populate_cache(struct uvc_device *dev,
+        struct uvc_control *ctrl)
+{
+    int ret;
+
+    if (ctrl->info.flags & UVC_CTRL_FLAG_GET_DEF) {
+        ret = uvc_ctrl_load_def(dev, ctrl);
+        if (ret < 0)
+            return ret;
+    }
+
+    if (ctrl->info.flags & UVC_CTRL_FLAG_GET_MIN) {
+        ret = uvc_query_ctrl(dev, UVC_GET_MIN, ctrl->entity->id,
+                dev->intfnum, ctrl->info.selector,
+                uvc_ctrl_data(ctrl, UVC_CTRL_DATA_MIN),
+                ctrl->info.size);
+        if (ret < 0)
+            return ret;
+    }
+
+    if (ctrl->info.flags & UVC_CTRL_FLAG_GET_MAX) {
+        ret = uvc_query_ctrl(dev, UVC_GET_MAX, ctrl->entity->id,
+                dev->intfnum, ctrl->info.selector,
+                uvc_ctrl_data(ctrl, UVC_CTRL_DATA_MAX),
+                ctrl->info.size);
+        if (ret < 0)
+            return ret;
     }
 
+    if (ctrl->info.flags & UVC_CTRL_FLAG_GET_RES) {
+        ret = uvc_query_ctrl(dev, UVC_GET_RES, ctrl->entity->id,
+                dev->intfnum, ctrl->info.selector,
+                uvc_ctrl_data(ctrl, UVC_CTRL_DATA_RES),
+                ctrl->info.size);
+        if (ret < 0) {
+            if (UVC_ENTITY_TYPE(ctrl->entity) !=
+                    UVC_VC_EXTENSION_UNIT)
+                return ret;
+
+            /* GET_RES is mandatory for XU controls, but some
+             * cameras still choke on it. Ignore errors and set the
+             * resolution value to zero.
+             */
+            uvc_warn_once(dev, UVC_WARN_XU_GET_RES,
+                    "UVC non compliance - GET_RES failed on "
+                    "an XU control. Enabling workaround.\n");
+            memset(uvc_ctrl_data(ctrl, UVC_CTRL_DATA_RES), 0,
+                    ctrl->info.size);
+        }
+    }
+
+    ctrl->cached = 1;
+    return 0;
+}
+
+static int uvc_ctrl_load_cur(struct uvc_device *dev, struct uvc_control *ctrl)
+{
+    unsigned long flags;
+    bool stale;
+    bool fresh;
+    int ret;
+
+    if (!(ctrl->info.flags & UVC_CTRL_FLAG_GET_CUR))
+        return -EACCES;
+
+    /* A failed asynchronous write leaves the cached value out of sync,
+     * while a value reported by a status event is up to date even for
+     * auto-update controls.
+     */
+    spin_lock_irqsave(&dev->async_ctrl.lock, flags);
+    stale = ctrl->async_failed;
+    ctrl->async_failed = false;
+    fresh = ctrl->status_gen == dev->async_ctrl.status_gen;
+    spin_unlock_irqrestore(&dev->async_ctrl.lock, flags);
+
+    if (!stale && (fresh || (ctrl->loaded &&
+            !(ctrl->info.flags & UVC_CTRL_FLAG_AUTO_UPDATE))))
+        return 0;
+
+    ret = uvc_query_ctrl(dev, UVC_GET_CUR, ctrl->entity->id,
+            dev->intfnum, ctrl->info.selector,
+            uvc_ctrl_data(ctrl, UVC_CTRL_DATA_CURRENT),
+            ctrl->info.size);
+    if (ret < 0)
+        return ret;
+
+    ctrl->loaded = 1;
     return 0;
 }
 
+size_t uvc_ctrl_snapshot_size(struct uvc_video_chain *chain)
+{
+    struct uvc_entity *entity;
+    size_t size = sizeof(struct uvc_ctrl_snapshot_header);
+    unsigned int i;
+
+    mutex_lock(&chain->ctrl_mutex);
+
+    list_for_each_entry(entity, &chain->entities, chain) {
+        for (i = 0; i < entity->ncontrols; ++i) {
+            struct uvc_control *ctrl = &entity->controls[i];
+
+            if (!ctrl->initialized)
+                continue;
+
+            size += sizeof(struct uvc_ctrl_snapshot_entry)
+                  + 5 * ctrl->info.size;
+        }
+    }
+
+    mutex_unlock(&chain->ctrl_mutex);
+
+    return size;
+}
+
+/*
+ * Fill the buffer with the values of all initialized controls in the chain.
+ * Return the number of bytes written, or -ENOSPC if the buffer is too small.
+ * Controls that fail to respond are reported with the corresponding valid
+ * bits cleared instead of aborting the whole snapshot.
+ */
+ssize_t uvc_ctrl_snapshot(struct uvc_video_chain *chain, void *buf,
+        size_t size)
+{
+    static const struct {
+        unsigned int id;
+        __u8 valid;
+        __u32 flag;
+    } slots[] = {
+        { UVC_CTRL_DATA_CURRENT, UVC_CTRL_SNAPSHOT_CUR,
+          UVC_CTRL_FLAG_GET_CUR },
+        { UVC_CTRL_DATA_MIN, UVC_CTRL_SNAPSHOT_MIN, UVC_CTRL_FLAG_GET_MIN },
+        { UVC_CTRL_DATA_MAX, UVC_CTRL_SNAPSHOT_MAX, UVC_CTRL_FLAG_GET_MAX },
+        { UVC_CTRL_DATA_RES, UVC_CTRL_SNAPSHOT_RES, UVC_CTRL_FLAG_GET_RES },
+        { UVC_CTRL_DATA_DEF, UVC_CTRL_SNAPSHOT_DEF, UVC_CTRL_FLAG_GET_DEF },
+    };
+
+    struct uvc_device *dev = chain->dev;
+    struct uvc_ctrl_snapshot_header *header = buf;
+    struct uvc_entity *entity;
+    __u8 *p = buf + sizeof(*header);
+    __u8 *end = buf + size;
+    unsigned int count = 0;
+    unsigned int i, j;
+    ssize_t ret;
+
+    if (size < sizeof(*header))
+        return -ENOSPC;
+
+    mutex_lock(&chain->ctrl_mutex);
+
+    list_for_each_entry(entity, &chain->entities, chain) {
+        for (i = 0; i < entity->ncontrols; ++i) {
+            struct uvc_control *ctrl = &entity->controls[i];
+            struct uvc_ctrl_snapshot_entry *entry;
+            __u8 valid = 0;
+
+            if (!ctrl->initialized)
+                continue;
+
+            if (end - p < sizeof(*entry) + 5 * ctrl->info.size) {
+                ret = -ENOSPC;
+                goto done;
+            }
+
+            if (!ctrl->cached)
+                uvc_ctrl_populate_cache(dev, ctrl);
+            if (ctrl->cached)
+                valid |= UVC_CTRL_SNAPSHOT_MIN | UVC_CTRL_SNAPSHOT_MAX
+                       | UVC_CTRL_SNAPSHOT_RES | UVC_CTRL_SNAPSHOT_DEF;
+
+            if (uvc_ctrl_load_cur(dev, ctrl) == 0)
+                valid |= UVC_CTRL_SNAPSHOT_CUR;
+
+            entry = (struct uvc_ctrl_snapshot_entry *)p;
+            entry->entity = entity->id;
+            entry->selector = ctrl->info.selector;
+            entry->size = ctrl->info.size;
+            entry->flags = ctrl->info.flags;
+            entry->valid = 0;
+            memset(entry->reserved, 0, sizeof(entry->reserved));
+            p += sizeof(*entry);
+
+            for (j = 0; j < ARRAY_SIZE(slots); ++j) {
+                if ((valid & slots[j].valid) &&
+                        (ctrl->info.flags & slots[j].flag)) {
+                    if (slots[j].id == UVC_CTRL_DATA_CURRENT)
+                        uvc_ctrl_get_cur(dev, ctrl, p);
+                    else
+                        memcpy(p, uvc_ctrl_data(ctrl, slots[j].id),
+                                ctrl->info.size);
+                    entry->valid |= slots[j].valid;
+                } else {
+                    memset(p, 0, ctrl->info.size);
+                }
+                p += ctrl->info.size;
+            }
+
+            count++;
+        }
+    }
+
+    header->version = UVC_CTRL_SNAPSHOT_VERSION;
+    header->count = count;
+    ret = p - (__u8 *)buf;
+
+done:
+    mutex_unlock(&chain->ctrl_mutex);
+    return ret;
+}
+
 /* --------------------------------------------------------------------------
  * Suspend/resume
  */
 
 /*
  * Restore control values after resume, skipping controls that haven't been
- * changed.
+ * changed or that are back to their default value.
  *
- * TODO
- * - Don't restore modified controls that are back to their default value.
- * - Handle restore order (Auto-Exposure Mode should be restored before
- *   Exposure Time).
+ * Controls are restored in dependency order: controls that don't depend on
+ * any other control (including masters such as Auto-Exposure Mode) go in the
+ * first stage, and controls with a master (such as Exposure Time) in the
+ * second one. All SET_CUR requests of a stage are submitted at once as
+ * asynchronous control URBs, and the stage completes when all of them have
+ * been acknowledged by the device.
  */
 
+struct uvc_ctrl_restore {
+    struct usb_anchor anchor;
+    atomic_t errors;
+};
+
+/*
+ * Must be called with the chain control mutex held.
+ */
+static bool uvc_ctrl_needs_restore(struct uvc_control *ctrl)
+{
+    if ((ctrl->info.flags & UVC_CTRL_FLAG_RESTORE) == 0)
+        return false;
+
+    if (!ctrl->modified && !ctrl->async_written)
+        return false;
+
+    /* The device resets its controls to their default value, there's no
+     * need to restore controls that are back to it. Controls whose default
+     * value hasn't been cached are always restored, a SET_CUR in the
+     * pipelined batch is cheaper than a synchronous GET_DEF.
+     */
+    if (ctrl->def_loaded &&
+            memcmp(uvc_ctrl_data(ctrl, UVC_CTRL_DATA_CURRENT),
+                   uvc_ctrl_data(ctrl, UVC_CTRL_DATA_DEF),
+                   ctrl->info.size) == 0)
+        return false;
+
+    return true;
+}
+
+/*
+ * Once restored, a value written asynchronously is accounted for as modified
+ * like the ones committed synchronously, and async_written only tracks writes
+ * issued since the last restore. Must be called with the chain control mutex
+ * held.
+ */
+static void uvc_ctrl_restore_done(struct uvc_device *dev,
+        struct uvc_control *ctrl)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&dev->async_ctrl.lock, flags);
+    if (ctrl->async_written) {
+        ctrl->async_written = false;
+        ctrl->modified = 1;
+    }
+    spin_unlock_irqrestore(&dev->async_ctrl.lock, flags);
+}
+
+static unsigned int uvc_ctrl_restore_stage(struct uvc_control *ctrl)
+{
+    struct uvc_control_mapping *mapping;
+
+    list_for_each_entry(mapping, &ctrl->info.mappings, list) {
+        if (mapping->master_id)
+            return 1;
+    }
+
+    return 0;
+}
+
+static void uvc_ctrl_restore_complete(struct urb *urb)
+{
+    struct uvc_ctrl_restore *restore = urb->context;
+
+    if (urb->status < 0)
+        atomic_inc(&restore->errors);
+
+    kfree(urb->setup_packet);
+}
+
+static int uvc_ctrl_restore_submit(struct uvc_device *dev,
+        struct uvc_ctrl_restore *restore, struct uvc_control *ctrl)
+{
+    struct usb_ctrlrequest *setup;
+    struct urb *urb;
+    int ret;
+
+    urb = usb_alloc_urb(0, GFP_NOIO);
+    if (urb == NULL)
+        return -ENOMEM;
+
+    /* The setup packet and the control value share a single allocation,
+     * freed by the completion handler.
+     */
+    setup = kmalloc(sizeof(*setup) + ctrl->info.size, GFP_NOIO);
+    if (setup == NULL) {
+        usb_free_urb(urb);
+        return -ENOMEM;
+    }
+
+    setup->bRequestType = USB_TYPE_CLASS | USB_RECIP_INTERFACE | USB_DIR_OUT;
+    setup->bRequest = UVC_SET_CUR;
+    setup->wValue = cpu_to_le16(ctrl->info.selector << 8);
+    setup->wIndex = cpu_to_le16(ctrl->entity->id << 8 | dev->intfnum);
+    setup->wLength = cpu_to_le16(ctrl->info.size);
+    memcpy(setup + 1, uvc_ctrl_data(ctrl, UVC_CTRL_DATA_CURRENT),
+            ctrl->info.size);
+
+    usb_fill_control_urb(urb, dev->udev, usb_sndctrlpipe(dev->udev, 0),
+            (unsigned char *)setup, setup + 1, ctrl->info.size,
+            uvc_ctrl_restore_complete, restore);
+
+    usb_anchor_urb(urb, &restore->anchor);
+    ret = usb_submit_urb(urb, GFP_NOIO);
+    if (ret < 0) {
+        usb_unanchor_urb(urb);
+        kfree(setup);
+    }
+
+    /* The anchor holds its own reference until completion. */
+    usb_free_urb(urb);
+    return ret;
+}
+
+static int uvc_ctrl_restore_wait(struct uvc_ctrl_restore *restore,
+        unsigned int count)
+{
+    if (!usb_wait_anchor_empty_timeout(&restore->anchor,
+                UVC_CTRL_CONTROL_TIMEOUT * count)) {
+        usb_kill_anchored_urbs(&restore->anchor);
+        return -ETIMEDOUT;
+    }
+
+    return atomic_read(&restore->errors) ? -EIO : 0;
+}
+
 // complete    // from uvc_driver resume
 int uvc_ctrl_restore_values(struct uvc_device *dev)
 {
+    struct uvc_ctrl_restore restore;
+    struct uvc_video_chain *chain;
     struct uvc_control *ctrl;
     struct uvc_entity *entity;
+    unsigned int stage;
+    unsigned int count;
     unsigned int i;
+    bool needed;
     int ret;
 
-    /* Walk the entities list and restore controls when possible. */
-    list_for_each_entry(entity, &dev->entities, list) {
+    init_usb_anchor(&restore.anchor);
+    atomic_set(&restore.errors, 0);
 
-        for (i = 0; i < entity->ncontrols; ++i) {
-            ctrl = &entity->controls[i];
+    /* Let asynchronous writes update the cached values first. */
+    flush_work(&dev->async_ctrl.work);
 
-            if (!ctrl->initialized || !ctrl->modified ||
-                    (ctrl->info.flags & UVC_CTRL_FLAG_RESTORE) == 0)
-                continue;
+    for (stage = 0; stage < 2; ++stage) {
+        count = 0;
+
+        /* Walk the entities list and queue the controls of this stage. */
+        list_for_each_entry(entity, &dev->entities, list) {
+
+            for (i = 0; i < entity->ncontrols; ++i) {
+                ctrl = &entity->controls[i];
+
+                if (!ctrl->initialized ||
+                        uvc_ctrl_restore_stage(ctrl) != stage)
+                    continue;
+
+                chain = ctrl->chain;
+                if (chain == NULL)
+                    continue;
+
+                mutex_lock(&chain->ctrl_mutex);
+
+                needed = uvc_ctrl_needs_restore(ctrl);
+                if (needed) {
+                    uvc_trace(UVC_TRACE_CONTROL, "restoring control "
+                            "%pUl/%u/%u\n", ctrl->info.entity,
+                            ctrl->info.index, ctrl->info.selector);
+
+                    ret = uvc_ctrl_restore_submit(dev, &restore, ctrl);
+                } else {
+                    ret = 0;
+                }
+
+                if (ret == 0)
+                    uvc_ctrl_restore_done(dev, ctrl);
+
+                mutex_unlock(&chain->ctrl_mutex);
+
+                if (ret < 0) {
+                    usb_kill_anchored_urbs(&restore.anchor);
+                    return ret;
+                }
 
-            printk(KERN_INFO "restoring control %pUl/%u/%u\n",
-                    ctrl->info.entity, ctrl->info.index,
-                    ctrl->info.selector);
-            ctrl->dirty = 1;
+                if (needed)
+                    count++;
+            }
         }
 
-        ret = uvc_ctrl_commit_entity(dev, entity, 0);
-        if (ret < 0)
+        if (count == 0)
+            continue;
+
+        ret = uvc_ctrl_restore_wait(&restore, count);
+        if (ret < 0) {
+            uvc_printk(KERN_ERR, "Failed to restore controls (%d).\n",
+                    ret);
             return ret;
+        }
     }
 
     return 0;
@@ -982,6 +1674,7 @@ static int uvc_ctrl_add_info(struct uvc_device *dev, struct uvc_control *ctrl,
         goto done;
     }
 
+    INIT_LIST_HEAD(&ctrl->async);
     ctrl->initialized = 1;
 
     uvc_trace(UVC_TRACE_CONTROL, "Added control %pUl/%u to device %s "
@@ -1120,8 +1813,8 @@ static void uvc_ctrl_init_ctrl(struct uvc_device *dev, struct uvc_control *ctrl)
         return;
 
     for (; info < iend; ++info) {
-        if (uvc_entity_match_guid(ctrl->entity, info->entity) &&
-                ctrl->index == info->index) {
+        if (ctrl->index == info->index &&
+                uvc_entity_match_guid(ctrl->entity, info->entity)) {
             uvc_ctrl_add_info(dev, ctrl, info);
             break;
         }
@@ -1131,8 +1824,8 @@ static void uvc_ctrl_init_ctrl(struct uvc_device *dev, struct uvc_control *ctrl)
         return;
 
     for (; mapping < mend; ++mapping) {
-        if (uvc_entity_match_guid(ctrl->entity, mapping->entity) &&
-                ctrl->info.selector == mapping->selector)
+        if (ctrl->info.selector == mapping->selector &&
+                uvc_entity_match_guid(ctrl->entity, mapping->entity))
             __uvc_ctrl_add_mapping(dev, ctrl, mapping);
     }
 }
@@ -1149,6 +1842,13 @@ int uvc_ctrl_init_device(struct uvc_device *dev)
     struct uvc_entity *entity;
     unsigned int i;
 
+    spin_lock_init(&dev->async_ctrl.lock);
+    INIT_LIST_HEAD(&dev->async_ctrl.pending);
+    INIT_WORK(&dev->async_ctrl.work, uvc_ctrl_async_work);
+    dev->async_ctrl.status_gen = 1;
+
+    hash_init(dev->ctrl_hash);
+
     /* Walk the entities list and instantiate controls */
     list_for_each_entry(entity, &dev->entities, list) {
         struct uvc_control *ctrl;
@@ -1190,6 +1890,12 @@ int uvc_ctrl_init_device(struct uvc_device *dev)
             ctrl->index = i;
 
             uvc_ctrl_init_ctrl(dev, ctrl);
+
+            if (ctrl->initialized ||
+                    UVC_ENTITY_TYPE(entity) == UVC_VC_EXTENSION_UNIT)
+                hash_add(dev->ctrl_hash, &ctrl->hash,
+                        uvc_ctrl_hash_key(entity->id,
+                            uvc_ctrl_selector(ctrl)));
             ctrl++;
         }
     }
@@ -1197,6 +1903,21 @@ int uvc_ctrl_init_device(struct uvc_device *dev)
     return 0;
 }
 
+/*
+ * Link the controls of all entities in the chain to the chain, whose control
+ * mutex protects them. Called once the device chains have been scanned.
+ */
+void uvc_ctrl_init_chain(struct uvc_video_chain *chain)
+{
+    struct uvc_entity *entity;
+    unsigned int i;
+
+    list_for_each_entry(entity, &chain->entities, chain) {
+        for (i = 0; i < entity->ncontrols; ++i)
+            entity->controls[i].chain = chain;
+    }
+}
+
 /*
  * Cleanup device controls.
  */
@@ -1220,6 +1941,10 @@ void uvc_ctrl_cleanup_device(struct uvc_device *dev)
     struct uvc_entity *entity;
     unsigned int i;
 
+    /* Can be uninitialized if we are aborting on probe error. */
+    if (dev->async_ctrl.work.func)
+        cancel_work_sync(&dev->async_ctrl.work);
+
     /* Free controls and control mappings for all entities. */
     list_for_each_entry(entity, &dev->entities, list) {
         for (i = 0; i < entity->ncontrols; ++i) {
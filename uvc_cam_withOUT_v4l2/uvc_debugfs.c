@@ -29,7 +29,12 @@ struct uvc_debugfs_buffer {
 	char data[UVC_DEBUGFS_BUF_SIZE];
 };
 
-static int uvc_debugfs_stats_open(struct inode *inode, struct file *file)
+/*
+ * Open a read-only file holding the text dumped by 'dump' for the stream
+ * stored in the inode private data.
+ */
+static int uvc_debugfs_dump_open(struct inode *inode, struct file *file,
+	size_t (*dump)(struct uvc_streaming *stream, char *buf, size_t size))
 {
 	struct uvc_streaming *stream = inode->i_private;
 	struct uvc_debugfs_buffer *buf;
@@ -38,7 +43,7 @@ static int uvc_debugfs_stats_open(struct inode *inode, struct file *file)
 	if (buf == NULL)
 		return -ENOMEM;
 
-	buf->count = uvc_video_stats_dump(stream, buf->data, sizeof(buf->data));
+	buf->count = dump(stream, buf->data, sizeof(buf->data));
 
 	file->private_data = buf;
 	return 0;
@@ -61,11 +66,107 @@ static int uvc_debugfs_stats_release(struct inode *inode, struct file *file)
 	return 0;
 }
 
-static const struct file_operations uvc_debugfs_stats_fops = {
+#define UVC_DEBUGFS_DUMP_FOPS(name, dump)				\
+static int uvc_debugfs_##name##_open(struct inode *inode,		\
+				     struct file *file)			\
+{									\
+	return uvc_debugfs_dump_open(inode, file, dump);		\
+}									\
+									\
+static const struct file_operations uvc_debugfs_##name##_fops = {	\
+	.owner = THIS_MODULE,						\
+	.open = uvc_debugfs_##name##_open,				\
+	.llseek = no_llseek,						\
+	.read = uvc_debugfs_stats_read,					\
+	.release = uvc_debugfs_stats_release,				\
+}
+
+UVC_DEBUGFS_DUMP_FOPS(stats, uvc_video_stats_dump);
+UVC_DEBUGFS_DUMP_FOPS(recovery, uvc_video_recovery_dump);
+UVC_DEBUGFS_DUMP_FOPS(pacing, uvc_video_pacing_dump);
+UVC_DEBUGFS_DUMP_FOPS(standby, uvc_video_standby_dump);
+UVC_DEBUGFS_DUMP_FOPS(errors, uvc_video_urb_errors_dump);
+UVC_DEBUGFS_DUMP_FOPS(start, uvc_video_start_dump);
+
+/* -----------------------------------------------------------------------------
+ * Controls snapshot
+ */
+
+struct uvc_debugfs_blob {
+	size_t count;
+	char data[];
+};
+
+static int uvc_debugfs_controls_open(struct inode *inode, struct file *file)
+{
+	struct uvc_streaming *stream = inode->i_private;
+	struct uvc_debugfs_blob *blob;
+	size_t size;
+	ssize_t ret;
+
+	if (stream->chain == NULL)
+		return -ENODEV;
+
+	size = uvc_ctrl_snapshot_size(stream->chain);
+	blob = kmalloc(sizeof(*blob) + size, GFP_KERNEL);
+	if (blob == NULL)
+		return -ENOMEM;
+
+	ret = uvc_ctrl_snapshot(stream->chain, blob->data, size);
+	if (ret < 0) {
+		kfree(blob);
+		return ret;
+	}
+
+	blob->count = ret;
+	file->private_data = blob;
+	return 0;
+}
+
+static ssize_t uvc_debugfs_controls_read(struct file *file,
+					 char __user *user_buf, size_t nbytes,
+					 loff_t *ppos)
+{
+	struct uvc_debugfs_blob *blob = file->private_data;
+
+	return simple_read_from_buffer(user_buf, nbytes, ppos, blob->data,
+				       blob->count);
+}
+
+static const struct file_operations uvc_debugfs_controls_fops = {
 	.owner = THIS_MODULE,
-	.open = uvc_debugfs_stats_open,
+	.open = uvc_debugfs_controls_open,
 	.llseek = no_llseek,
-	.read = uvc_debugfs_stats_read,
+	.read = uvc_debugfs_controls_read,
+	.release = uvc_debugfs_stats_release,
+};
+
+/* -----------------------------------------------------------------------------
+ * Probe timing report
+ */
+
+#define UVC_DEBUGFS_PROBE_SIZE	4096
+
+static int uvc_debugfs_probe_open(struct inode *inode, struct file *file)
+{
+	struct uvc_debugfs_blob *blob;
+
+	blob = kmalloc(sizeof(*blob) + UVC_DEBUGFS_PROBE_SIZE, GFP_KERNEL);
+	if (blob == NULL)
+		return -ENOMEM;
+
+	blob->count = uvc_probe_report_dump(blob->data,
+					    UVC_DEBUGFS_PROBE_SIZE);
+
+	file->private_data = blob;
+	return 0;
+}
+
+static const struct file_operations uvc_debugfs_probe_fops = {
+	.owner = THIS_MODULE,
+	.open = uvc_debugfs_probe_open,
+	.llseek = no_llseek,
+	.read = uvc_debugfs_controls_read,
 	.release = uvc_debugfs_stats_release,
 };
 
@@ -102,6 +203,55 @@ void uvc_debugfs_init_stream(struct uvc_streaming *stream)
 		uvc_debugfs_cleanup_stream(stream);
 		return;
 	}
+
+	dent = debugfs_create_file("controls", 0444, stream->debugfs_dir,
+				   stream, &uvc_debugfs_controls_fops);
+	if (IS_ERR_OR_NULL(dent)) {
+		uvc_printk(KERN_INFO, "Unable to create debugfs controls "
+			   "file.\n");
+		uvc_debugfs_cleanup_stream(stream);
+		return;
+	}
+
+	dent = debugfs_create_file("recovery", 0444, stream->debugfs_dir,
+				   stream, &uvc_debugfs_recovery_fops);
+	if (IS_ERR_OR_NULL(dent)) {
+		uvc_printk(KERN_INFO, "Unable to create debugfs recovery "
+			   "file.\n");
+		uvc_debugfs_cleanup_stream(stream);
+		return;
+	}
+
+	debugfs_create_file("start", 0444, stream->debugfs_dir, stream,
+			    &uvc_debugfs_start_fops);
+	debugfs_create_file("errors", 0444, stream->debugfs_dir, stream,
+			    &uvc_debugfs_errors_fops);
+
+	if (stream->type == VIDEO_BUF_TYPE_VIDEO_OUTPUT)
+		debugfs_create_file("pacing", 0444, stream->debugfs_dir,
+				    stream, &uvc_debugfs_pacing_fops);
+	else
+		debugfs_create_file("standby", 0444, stream->debugfs_dir,
+				    stream, &uvc_debugfs_standby_fops);
+
+	/* Corrupted frames policy, see enum uvc_frame_policy. */
+	if (stream->type != VIDEO_BUF_TYPE_VIDEO_OUTPUT) {
+		debugfs_create_u32("frame_policy", 0644, stream->debugfs_dir,
+				   &stream->queue.policy);
+		debugfs_create_u32("loss_threshold", 0644, stream->debugfs_dir,
+				   &stream->queue.loss_threshold);
+		debugfs_create_u32("dedup_threshold", 0644,
+				   stream->debugfs_dir,
+				   &stream->dedup.threshold);
+		debugfs_create_u32("dedup_skipped", 0444, stream->debugfs_dir,
+				   &stream->dedup.skipped);
+	}
+
+	/* Sub-frame delivery watermarks, applied at the next stream start. */
+	debugfs_create_u32("watermark_bytes", 0644, stream->debugfs_dir,
+			   &stream->watermark.bytes);
+	debugfs_create_u32("watermark_lines", 0644, stream->debugfs_dir,
+			   &stream->watermark.lines);
 }
 
 void uvc_debugfs_cleanup_stream(struct uvc_streaming *stream)
@@ -124,6 +274,9 @@ void uvc_debugfs_init(void)
 	}
 
 	uvc_debugfs_root_dir = dir;
+
+	debugfs_create_file("probe", 0444, uvc_debugfs_root_dir, NULL,
+			    &uvc_debugfs_probe_fops);
 }
 
 void uvc_debugfs_cleanup(void)
@@ -11,9 +11,12 @@
  *
  */
 
+#include <linux/async.h>
 #include <linux/atomic.h>
+#include <linux/jhash.h>
 #include <linux/kernel.h>
 #include <linux/list.h>
+#include <linux/math64.h>
 #include <linux/module.h>
 #include <linux/slab.h>
 #include <linux/usb.h>
@@ -34,6 +37,11 @@
 unsigned int uvc_clock_param = CLOCK_MONOTONIC;
 unsigned int uvc_hw_timestamps_param;
 unsigned int uvc_no_drop_param;
+unsigned int uvc_nal_param;
+unsigned int uvc_pacing_param = 1;
+unsigned int uvc_standby_param;
+unsigned int uvc_fast_sync_param = 1;
+unsigned int uvc_mjpeg_check_param;
 static unsigned int uvc_quirks_param = -1;
 unsigned int uvc_trace_param;
 unsigned int uvc_timeout_param = UVC_CTRL_STREAMING_TIMEOUT;
@@ -43,16 +51,134 @@ int uvc_queue_init(struct uvc_video_queue *queue, enum video_buf_type type,
  * Video formats
  */
 
+/* Formats are listed with their decode hints: raw formats have a fixed frame
+ * size computed from the bytes per line of their first plane, compressed
+ * formats are variable-size. All known formats are copied to the buffer
+ * without conversion.
+ */
 static struct uvc_format_desc uvc_fmts[] = {
     {
         .name		= "YUV 4:2:2 (YUYV)",
         .guid		= UVC_GUID_FORMAT_YUY2,
         .fcc		= VIDEO_PIX_FMT_YUYV,
+        .hints		= UVC_FMT_HINT_FIXED_SIZE | UVC_FMT_HINT_DIRECT,
+        .bpl_depth	= 16,
+    },
+    {
+        .name		= "YUV 4:2:2 (UYVY)",
+        .guid		= UVC_GUID_FORMAT_UYVY,
+        .fcc		= VIDEO_PIX_FMT_UYVY,
+        .hints		= UVC_FMT_HINT_FIXED_SIZE | UVC_FMT_HINT_DIRECT,
+        .bpl_depth	= 16,
+    },
+    {
+        .name		= "YUV 4:2:0 (NV12)",
+        .guid		= UVC_GUID_FORMAT_NV12,
+        .fcc		= VIDEO_PIX_FMT_NV12,
+        .hints		= UVC_FMT_HINT_FIXED_SIZE | UVC_FMT_HINT_DIRECT,
+        .bpl_depth	= 8,
+    },
+    {
+        .name		= "YVU 4:2:0 (YV12)",
+        .guid		= UVC_GUID_FORMAT_YV12,
+        .fcc		= VIDEO_PIX_FMT_YVU420,
+        .hints		= UVC_FMT_HINT_FIXED_SIZE | UVC_FMT_HINT_DIRECT,
+        .bpl_depth	= 8,
+    },
+    {
+        .name		= "YUV 4:2:0 (I420)",
+        .guid		= UVC_GUID_FORMAT_I420,
+        .fcc		= VIDEO_PIX_FMT_YUV420,
+        .hints		= UVC_FMT_HINT_FIXED_SIZE | UVC_FMT_HINT_DIRECT,
+        .bpl_depth	= 8,
+    },
+    {
+        .name		= "Greyscale 8-bit (Y800)",
+        .guid		= UVC_GUID_FORMAT_Y800,
+        .fcc		= VIDEO_PIX_FMT_GREY,
+        .hints		= UVC_FMT_HINT_FIXED_SIZE | UVC_FMT_HINT_DIRECT,
+        .bpl_depth	= 8,
+    },
+    {
+        .name		= "Greyscale 8-bit (Y8  )",
+        .guid		= UVC_GUID_FORMAT_Y8,
+        .fcc		= VIDEO_PIX_FMT_GREY,
+        .hints		= UVC_FMT_HINT_FIXED_SIZE | UVC_FMT_HINT_DIRECT,
+        .bpl_depth	= 8,
+    },
+    {
+        .name		= "Greyscale 10-bit (Y10 )",
+        .guid		= UVC_GUID_FORMAT_Y10,
+        .fcc		= VIDEO_PIX_FMT_Y10,
+        .hints		= UVC_FMT_HINT_FIXED_SIZE | UVC_FMT_HINT_DIRECT,
+        .bpl_depth	= 16,
+    },
+    {
+        .name		= "Greyscale 12-bit (Y12 )",
+        .guid		= UVC_GUID_FORMAT_Y12,
+        .fcc		= VIDEO_PIX_FMT_Y12,
+        .hints		= UVC_FMT_HINT_FIXED_SIZE | UVC_FMT_HINT_DIRECT,
+        .bpl_depth	= 16,
+    },
+    {
+        .name		= "Greyscale 16-bit (Y16 )",
+        .guid		= UVC_GUID_FORMAT_Y16,
+        .fcc		= VIDEO_PIX_FMT_Y16,
+        .hints		= UVC_FMT_HINT_FIXED_SIZE | UVC_FMT_HINT_DIRECT,
+        .bpl_depth	= 16,
+    },
+    {
+        .name		= "RGB565",
+        .guid		= UVC_GUID_FORMAT_RGBP,
+        .fcc		= VIDEO_PIX_FMT_RGB565,
+        .hints		= UVC_FMT_HINT_FIXED_SIZE | UVC_FMT_HINT_DIRECT,
+        .bpl_depth	= 16,
+    },
+    {
+        .name		= "BGR 8:8:8 (BGR3)",
+        .guid		= UVC_GUID_FORMAT_BGR3,
+        .fcc		= VIDEO_PIX_FMT_BGR24,
+        .hints		= UVC_FMT_HINT_FIXED_SIZE | UVC_FMT_HINT_DIRECT,
+        .bpl_depth	= 24,
+    },
+    {
+        .name		= "Depth data 16-bit (Z16)",
+        .guid		= UVC_GUID_FORMAT_Z16,
+        .fcc		= VIDEO_PIX_FMT_Z16,
+        .hints		= UVC_FMT_HINT_FIXED_SIZE | UVC_FMT_HINT_DIRECT,
+        .bpl_depth	= 16,
+    },
+    {
+        .name		= "Depth data 16-bit (INVZ)",
+        .guid		= UVC_GUID_FORMAT_INVZ,
+        .fcc		= VIDEO_PIX_FMT_Z16,
+        .hints		= UVC_FMT_HINT_FIXED_SIZE | UVC_FMT_HINT_DIRECT,
+        .bpl_depth	= 16,
+    },
+    {
+        .name		= "Infrared 10-bit (INVI)",
+        .guid		= UVC_GUID_FORMAT_INVI,
+        .fcc		= VIDEO_PIX_FMT_Y10,
+        .hints		= UVC_FMT_HINT_FIXED_SIZE | UVC_FMT_HINT_DIRECT,
+        .bpl_depth	= 16,
     },
     {
         .name		= "MJPEG",
         .guid		= UVC_GUID_FORMAT_MJPEG,
         .fcc		= VIDEO_PIX_FMT_MJPEG,
+        .hints		= UVC_FMT_HINT_DIRECT,
+    },
+    {
+        .name		= "H.264",
+        .guid		= UVC_GUID_FORMAT_H264,
+        .fcc		= VIDEO_PIX_FMT_H264,
+        .hints		= UVC_FMT_HINT_DIRECT,
+    },
+    {
+        .name		= "H.265",
+        .guid		= UVC_GUID_FORMAT_H265,
+        .fcc		= VIDEO_PIX_FMT_HEVC,
+        .hints		= UVC_FMT_HINT_DIRECT,
     },
 };
 
@@ -77,7 +203,14 @@ static struct uvc_format_desc *uvc_format_by_guid(const __u8 guid[16])
     unsigned int len = ARRAY_SIZE(uvc_fmts);
     unsigned int i;
 
+    /* Format GUIDs differ in their first 4 bytes (the FourCC for most of
+     * them), check those before comparing the full GUID.
+     */
     for (i = 0; i < len; ++i) {
+        if (get_unaligned((const u32 *)guid) !=
+                get_unaligned((const u32 *)uvc_fmts[i].guid))
+            continue;
+
         if (memcmp(guid, uvc_fmts[i].guid, 16) == 0)
             return &uvc_fmts[i];
     }
@@ -155,6 +288,7 @@ static int uvc_parse_format(struct uvc_device *dev,
     struct uvc_frame *frame;
     const unsigned char *start = buffer;
     unsigned int width_multiplier = 1;
+    unsigned int bpl_depth = 0;
     unsigned int interval;
     unsigned int i, n;
     __u8 ftype;
@@ -182,6 +316,8 @@ static int uvc_parse_format(struct uvc_device *dev,
                 strlcpy(format->name, fmtdesc->name,
                         sizeof format->name);
                 format->fcc = fmtdesc->fcc;
+                format->hints = fmtdesc->hints;
+                bpl_depth = fmtdesc->bpl_depth;
             } else {
                 uvc_printk(KERN_INFO, "Unknown video format %pUl\n",
                         &buffer[5]);
@@ -192,7 +328,29 @@ static int uvc_parse_format(struct uvc_device *dev,
 
             format->bpp = buffer[21];
 
-            ftype = UVC_VS_FRAME_UNCOMPRESSED;
+            /* Some devices report a format that doesn't match what they
+             * really send.
+             */
+            if (dev->quirks & UVC_QUIRK_FORCE_Y8) {
+                if (format->fcc == VIDEO_PIX_FMT_YUYV) {
+                    strlcpy(format->name, "Greyscale 8-bit (Y8  )",
+                            sizeof(format->name));
+                    format->fcc = VIDEO_PIX_FMT_GREY;
+                    format->bpp = 8;
+                    bpl_depth = 8;
+                    width_multiplier = 2;
+                }
+            }
+
+            if (buffer[2] == UVC_VS_FORMAT_UNCOMPRESSED) {
+                ftype = UVC_VS_FRAME_UNCOMPRESSED;
+            } else {
+                ftype = UVC_VS_FRAME_FRAME_BASED;
+                if (buffer[27]) {
+                    format->flags = UVC_FMT_FLAG_COMPRESSED;
+                    format->hints &= ~UVC_FMT_HINT_FIXED_SIZE;
+                }
+            }
             break;
 
         case UVC_VS_FORMAT_MJPEG:
@@ -207,6 +365,7 @@ static int uvc_parse_format(struct uvc_device *dev,
             strlcpy(format->name, "MJPEG", sizeof format->name);
             format->fcc = VIDEO_PIX_FMT_MJPEG;
             format->flags = UVC_FMT_FLAG_COMPRESSED;
+            format->hints = UVC_FMT_HINT_DIRECT;
             format->bpp = 0;
             ftype = UVC_VS_FRAME_MJPEG;
             break;
@@ -258,16 +417,29 @@ static int uvc_parse_format(struct uvc_device *dev,
             frame->bFrameIntervalType = buffer[21];
         }
         frame->dwFrameInterval = *intervals;
-        /* add
-           if (!(format->flags & UVC_FMT_FLAG_COMPRESSED))
-           frame->dwMaxVideoFrameBufferSize = format->bpp
-         * frame->wWidth * frame->wHeight / 8;
-
-         for (i = 0; i < n; ++i) {
-         interval = get_unaligned_le32(&buffer[26+4*i]);
-         *(*intervals)++ = interval ? interval : 1;
-         }
+
+        /* Frame based formats report their line length, compute it from
+         * the format depth for the others. Planar formats only account for
+         * their first plane.
          */
+        if (ftype == UVC_VS_FRAME_FRAME_BASED)
+            frame->bytesperline = get_unaligned_le32(&buffer[22]);
+        else
+            frame->bytesperline = bpl_depth * frame->wWidth / 8;
+
+        /* Without a known line length the frame size can't be trusted. */
+        if (frame->bytesperline == 0)
+            format->hints &= ~UVC_FMT_HINT_FIXED_SIZE;
+
+        /* Some bogus devices report dwMinFrameInterval equal to
+         * dwMaxFrameInterval and have dwFrameIntervalStep set to
+         * zero. Setting all null intervals to 1 fixes the problem and
+         * some other divisions by zero that could happen.
+         */
+        for (i = 0; i < n; ++i) {
+            interval = get_unaligned_le32(&buffer[26+4*i]);
+            *(*intervals)++ = interval ? interval : 1;
+        }
 
         /* Make sure that the default frame interval stays between
          * the boundaries.
@@ -305,6 +477,66 @@ static int uvc_parse_format(struct uvc_device *dev,
 
     return buffer - start;
 }
+/*
+ * Build the format and frame index lookup tables of a streaming interface.
+ * All tables share a single allocation.
+ */
+static int uvc_build_stream_tables(struct uvc_streaming *streaming)
+{
+    struct uvc_format *format;
+    struct uvc_frame *frame;
+    struct uvc_frame **frames;
+    unsigned int nformat_index = 0;
+    unsigned int nentries;
+    unsigned int i, j;
+
+    /* Size the tables. */
+    for (i = 0; i < streaming->nformats; ++i) {
+        format = &streaming->format[i];
+        nformat_index = max_t(unsigned int, nformat_index,
+                format->index + 1);
+
+        format->nframe_index = 0;
+        for (j = 0; j < format->nframes; ++j) {
+            frame = &format->frame[j];
+            format->nframe_index = max_t(unsigned int,
+                    format->nframe_index, frame->bFrameIndex + 1);
+        }
+    }
+
+    nentries = nformat_index;
+    for (i = 0; i < streaming->nformats; ++i)
+        nentries += streaming->format[i].nframe_index;
+
+    streaming->format_by_index = kcalloc(nentries, sizeof(void *),
+            GFP_KERNEL);
+    if (streaming->format_by_index == NULL)
+        return -ENOMEM;
+
+    streaming->nformat_index = nformat_index;
+    frames = (struct uvc_frame **)&streaming->format_by_index[nformat_index];
+
+    /* Fill them. Duplicate indexes resolve to the last descriptor, as the
+     * backward scans used to select the default format and frame did. The
+     * forward scans of uvc_fixup_video_ctrl() picked the first one, which
+     * could disagree with the frame selected by uvc_video_init().
+     */
+    for (i = 0; i < streaming->nformats; ++i) {
+        format = &streaming->format[i];
+        streaming->format_by_index[format->index] = format;
+
+        format->frame_by_index = frames;
+        frames += format->nframe_index;
+
+        for (j = 0; j < format->nframes; ++j) {
+            frame = &format->frame[j];
+            format->frame_by_index[frame->bFrameIndex] = frame;
+        }
+    }
+
+    return 0;
+}
+
 //complete cc
 static int uvc_parse_streaming(struct uvc_device *dev,
         struct usb_interface *intf)
@@ -336,6 +568,7 @@ static int uvc_parse_streaming(struct uvc_device *dev,
     }
 
     streaming->dev = dev;
+    mutex_init(&streaming->mutex);
     streaming->intf = usb_get_intf(intf);
     streaming->intfnum = intf->cur_altsetting->desc.bInterfaceNumber;
 
@@ -371,10 +604,12 @@ static int uvc_parse_streaming(struct uvc_device *dev,
     /* Parse the header descriptor. */
     switch (buffer[2]) {
         case UVC_VS_OUTPUT_HEADER:
+            streaming->type = VIDEO_BUF_TYPE_VIDEO_OUTPUT;
             size = 9;
             break;
 
         case UVC_VS_INPUT_HEADER:
+            streaming->type = VIDEO_BUF_TYPE_VIDEO_CAPTURE;
             size = 13;
             break;
 
@@ -418,6 +653,12 @@ static int uvc_parse_streaming(struct uvc_device *dev,
                     nintervals += _buffer[25] ? _buffer[25] : 3;
                 break;
 
+            case UVC_VS_FRAME_FRAME_BASED:
+                nframes++;
+                if (_buflen > 21)
+                    nintervals += _buffer[21] ? _buffer[21] : 3;
+                break;
+
         }
 
         _buflen -= _buffer[0];
@@ -477,6 +718,10 @@ static int uvc_parse_streaming(struct uvc_device *dev,
                 "%d has %u bytes of trailing descriptor garbage.\n",
                 dev->udev->devnum, alts->desc.bInterfaceNumber, buflen);
 
+    ret = uvc_build_stream_tables(streaming);
+    if (ret < 0)
+        goto error;
+
     /* Parse the alternate settings to find the maximum bandwidth. */
     for (i = 0; i < intf->num_altsetting; ++i) {
         struct usb_host_endpoint *ep;
@@ -499,6 +744,7 @@ error:
     usb_driver_release_interface(&uvc_driver.driver, intf);
     usb_put_intf(intf);
     kfree(streaming->format);
+    kfree(streaming->format_by_index);
     //	kfree(streaming->header.bmaControls);
     kfree(streaming);
     return ret;
@@ -1360,9 +1606,208 @@ static int uvc_scan_device(struct uvc_device *dev)
         return -1;
     }
 
+    list_for_each_entry(chain, &dev->chains, list)
+        uvc_ctrl_init_chain(chain);
+
     return 0;
 }
 
+/* ------------------------------------------------------------------------
+ * Probe cache
+ *
+ * Devices of the same model report the same descriptors and the same default
+ * streaming parameters. Results obtained from the device at probe time (the
+ * function name string and the default probe control of every streaming
+ * interface) are cached, keyed by VID:PID:bcdDevice and a hash of the raw
+ * configuration descriptors, to skip the corresponding control transfers
+ * when the same model is plugged again. The cache holds at most
+ * UVC_PROBE_CACHE_SIZE models and is only dropped when the module is
+ * unloaded.
+ */
+
+#define UVC_PROBE_CACHE_SIZE		16
+#define UVC_PROBE_CACHE_STREAMS		4
+
+struct uvc_probe_cache_entry {
+    struct list_head list;
+
+    u16 idVendor;
+    u16 idProduct;
+    u16 bcdDevice;
+    u32 hash;
+
+    char name[32];
+    bool has_name;
+
+    unsigned int nstreams;
+    struct {
+        int intfnum;
+        struct uvc_streaming_control ctrl;
+    } streams[UVC_PROBE_CACHE_STREAMS];
+};
+
+static unsigned int uvc_probe_cache_param = 1;
+static LIST_HEAD(uvc_probe_cache);
+static DEFINE_MUTEX(uvc_probe_cache_lock);
+static unsigned int uvc_probe_cache_count;
+
+static void uvc_probe_cache_key(struct uvc_device *dev)
+{
+    struct usb_device *udev = dev->udev;
+    unsigned int cfg = udev->actconfig - udev->config;
+
+    dev->desc_hash = jhash(udev->rawdescriptors[cfg],
+            le16_to_cpu(udev->actconfig->desc.wTotalLength), 0);
+}
+
+/* Must be called with the cache lock held. */
+static struct uvc_probe_cache_entry *
+uvc_probe_cache_find(struct uvc_device *dev, bool create)
+{
+    struct usb_device_descriptor *desc = &dev->udev->descriptor;
+    struct uvc_probe_cache_entry *entry;
+
+    list_for_each_entry(entry, &uvc_probe_cache, list) {
+        if (entry->idVendor == le16_to_cpu(desc->idVendor) &&
+                entry->idProduct == le16_to_cpu(desc->idProduct) &&
+                entry->bcdDevice == le16_to_cpu(desc->bcdDevice) &&
+                entry->hash == dev->desc_hash) {
+            list_move(&entry->list, &uvc_probe_cache);
+            return entry;
+        }
+    }
+
+    if (!create)
+        return NULL;
+
+    /* Recycle the least recently used entry when the cache is full. */
+    if (uvc_probe_cache_count == UVC_PROBE_CACHE_SIZE) {
+        entry = list_last_entry(&uvc_probe_cache,
+                struct uvc_probe_cache_entry, list);
+        list_del(&entry->list);
+        memset(entry, 0, sizeof(*entry));
+    } else {
+        entry = kzalloc(sizeof(*entry), GFP_KERNEL);
+        if (entry == NULL)
+            return NULL;
+        uvc_probe_cache_count++;
+    }
+
+    entry->idVendor = le16_to_cpu(desc->idVendor);
+    entry->idProduct = le16_to_cpu(desc->idProduct);
+    entry->bcdDevice = le16_to_cpu(desc->bcdDevice);
+    entry->hash = dev->desc_hash;
+    list_add(&entry->list, &uvc_probe_cache);
+
+    return entry;
+}
+
+static bool uvc_probe_cache_get_name(struct uvc_device *dev)
+{
+    struct uvc_probe_cache_entry *entry;
+    bool found = false;
+
+    if (!uvc_probe_cache_param)
+        return false;
+
+    mutex_lock(&uvc_probe_cache_lock);
+    entry = uvc_probe_cache_find(dev, false);
+    if (entry != NULL && entry->has_name) {
+        strlcpy(dev->name, entry->name, sizeof(dev->name));
+        found = true;
+    }
+    mutex_unlock(&uvc_probe_cache_lock);
+
+    return found;
+}
+
+static void uvc_probe_cache_put_name(struct uvc_device *dev)
+{
+    struct uvc_probe_cache_entry *entry;
+
+    if (!uvc_probe_cache_param)
+        return;
+
+    mutex_lock(&uvc_probe_cache_lock);
+    entry = uvc_probe_cache_find(dev, true);
+    if (entry != NULL) {
+        strlcpy(entry->name, dev->name, sizeof(entry->name));
+        entry->has_name = true;
+    }
+    mutex_unlock(&uvc_probe_cache_lock);
+}
+
+/*
+ * Retrieve the cached default probe control for a streaming interface.
+ * Return 0 on success or -ENOENT if the control isn't cached.
+ */
+int uvc_probe_cache_get_ctrl(struct uvc_streaming *stream,
+        struct uvc_streaming_control *ctrl)
+{
+    struct uvc_probe_cache_entry *entry;
+    unsigned int i;
+    int ret = -ENOENT;
+
+    if (!uvc_probe_cache_param)
+        return -ENOENT;
+
+    mutex_lock(&uvc_probe_cache_lock);
+    entry = uvc_probe_cache_find(stream->dev, false);
+    for (i = 0; entry != NULL && i < entry->nstreams; ++i) {
+        if (entry->streams[i].intfnum == stream->intfnum) {
+            *ctrl = entry->streams[i].ctrl;
+            ret = 0;
+            break;
+        }
+    }
+    mutex_unlock(&uvc_probe_cache_lock);
+
+    return ret;
+}
+
+void uvc_probe_cache_put_ctrl(struct uvc_streaming *stream,
+        const struct uvc_streaming_control *ctrl)
+{
+    struct uvc_probe_cache_entry *entry;
+    unsigned int i;
+
+    if (!uvc_probe_cache_param)
+        return;
+
+    mutex_lock(&uvc_probe_cache_lock);
+    entry = uvc_probe_cache_find(stream->dev, true);
+    if (entry == NULL)
+        goto done;
+
+    for (i = 0; i < entry->nstreams; ++i) {
+        if (entry->streams[i].intfnum == stream->intfnum)
+            break;
+    }
+
+    if (i == UVC_PROBE_CACHE_STREAMS)
+        goto done;
+
+    entry->streams[i].intfnum = stream->intfnum;
+    entry->streams[i].ctrl = *ctrl;
+    if (i == entry->nstreams)
+        entry->nstreams++;
+
+done:
+    mutex_unlock(&uvc_probe_cache_lock);
+}
+
+static void uvc_probe_cache_cleanup(void)
+{
+    struct uvc_probe_cache_entry *entry, *n;
+
+    list_for_each_entry_safe(entry, n, &uvc_probe_cache, list) {
+        list_del(&entry->list);
+        kfree(entry);
+    }
+
+    uvc_probe_cache_count = 0;
+}
+
 /* ------------------------------------------------------------------------
  * Video device registration and unregistration
  */
@@ -1396,10 +1841,20 @@ static void uvc_delete(struct kref *kref)
     list_for_each_safe(p, n, &dev->streams) {
         struct uvc_streaming *streaming;
         streaming = list_entry(p, struct uvc_streaming, list);
+        if (streaming->recovery.work.func)
+            cancel_work_sync(&streaming->recovery.work);
+        if (streaming->urb_errors.work.work.func)
+            cancel_delayed_work_sync(&streaming->urb_errors.work);
+        if (streaming->pacing.timer.function)
+            hrtimer_cancel(&streaming->pacing.timer);
+        if (streaming->ops != NULL)
+            uvc_video_cleanup(streaming);
+        uvc_nal_cleanup(streaming);
         usb_driver_release_interface(&uvc_driver.driver,
                 streaming->intf);
         usb_put_intf(streaming->intf);
         kfree(streaming->format);
+        kfree(streaming->format_by_index);
         kfree(streaming->header.bmaControls);
         kfree(streaming);
     }
@@ -1517,6 +1972,132 @@ static int uvc_register_chains(struct uvc_device *dev)
     return 0;
 }
 
+/* ------------------------------------------------------------------------
+ * Asynchronous probe
+ *
+ * uvc_probe() only parses the descriptors and claims the streaming
+ * interfaces. Control initialization, chain scanning, video streams
+ * registration (which queries the probe control) and status endpoint setup
+ * run in an asynchronous probe stage, so that devices, including devices on
+ * different buses, are initialized concurrently. Callbacks that need a fully
+ * initialized device wait for the asynchronous stage with uvc_probe_wait().
+ *
+ * The time spent in both stages is recorded in a report exposed through the
+ * debugfs 'probe' file.
+ */
+
+#define UVC_PROBE_REPORT_SIZE	32
+
+struct uvc_probe_record {
+    char name[32];
+    char path[16];
+    u64 sync_ns;
+    u64 async_ns;
+    u64 total_ns;
+    int result;
+};
+
+static unsigned int uvc_async_probe_param = 1;
+static struct uvc_probe_record uvc_probe_report[UVC_PROBE_REPORT_SIZE];
+static unsigned int uvc_probe_report_count;
+static DEFINE_MUTEX(uvc_probe_report_lock);
+
+static void uvc_probe_report_add(struct uvc_device *dev, u64 async_start,
+        int result)
+{
+    struct uvc_probe_record *record;
+    u64 now = ktime_get_ns();
+
+    mutex_lock(&uvc_probe_report_lock);
+    record = &uvc_probe_report[uvc_probe_report_count++ %
+        UVC_PROBE_REPORT_SIZE];
+    strlcpy(record->name, dev->name, sizeof(record->name));
+    snprintf(record->path, sizeof(record->path), "%u-%u",
+            dev->udev->bus->busnum, dev->udev->devnum);
+    record->sync_ns = dev->probe_sync_ns;
+    record->async_ns = now - async_start;
+    record->total_ns = now - dev->probe_start_ns;
+    record->result = result;
+    mutex_unlock(&uvc_probe_report_lock);
+}
+
+size_t uvc_probe_report_dump(char *buf, size_t size)
+{
+    struct uvc_probe_record *record;
+    unsigned int first;
+    unsigned int i;
+    size_t count = 0;
+
+    mutex_lock(&uvc_probe_report_lock);
+
+    first = uvc_probe_report_count > UVC_PROBE_REPORT_SIZE
+          ? uvc_probe_report_count - UVC_PROBE_REPORT_SIZE : 0;
+
+    for (i = first; i < uvc_probe_report_count; ++i) {
+        record = &uvc_probe_report[i % UVC_PROBE_REPORT_SIZE];
+        count += scnprintf(buf + count, size - count,
+                "%-8s sync %6llu us async %8llu us total %8llu us "
+                "(%d) %s\n", record->path,
+                div_u64(record->sync_ns, NSEC_PER_USEC),
+                div_u64(record->async_ns, NSEC_PER_USEC),
+                div_u64(record->total_ns, NSEC_PER_USEC),
+                record->result, record->name);
+    }
+
+    mutex_unlock(&uvc_probe_report_lock);
+
+    return count;
+}
+
+static void uvc_probe_async(void *data, async_cookie_t cookie)
+{
+    struct uvc_device *dev = data;
+    u64 start = ktime_get_ns();
+    int ret;
+
+    /* Initialize controls. */
+    ret = uvc_ctrl_init_device(dev);
+    if (ret < 0)
+        goto done;
+
+    /* Scan the device for video chains. */
+    ret = uvc_scan_device(dev);
+    if (ret < 0)
+        goto done;
+
+    /* Register video device nodes. */
+    ret = uvc_register_chains(dev);
+    if (ret < 0)
+        goto done;
+
+    /* Initialize the interrupt URB. */
+    if ((ret = uvc_status_init(dev)) < 0) {
+        uvc_printk(KERN_INFO, "Unable to initialize the status "
+                "endpoint (%d), status interrupt will not be "
+                "supported.\n", ret);
+    }
+
+    uvc_trace(UVC_TRACE_PROBE, "UVC device initialized.\n");
+    usb_enable_autosuspend(dev->udev);
+    ret = 0;
+
+done:
+    /* On failure the device is left unregistered until disconnected,
+     * uvc_disconnect() takes care of the cleanup.
+     */
+    if (ret < 0)
+        uvc_printk(KERN_ERR, "Failed to initialize %s (%d).\n",
+                dev->name, ret);
+
+    uvc_probe_report_add(dev, start, ret);
+    complete_all(&dev->probe_done);
+}
+
+static void uvc_probe_wait(struct uvc_device *dev)
+{
+    wait_for_completion(&dev->probe_done);
+}
+
 //complete`
 static int uvc_probe(struct usb_interface *intf,
         const struct usb_device_id *id)
@@ -1524,7 +2105,6 @@ static int uvc_probe(struct usb_interface *intf,
     struct usb_device *udev = interface_to_usbdev(intf);
     struct uvc_device *dev;
     int function;
-    int ret;
 
     if (id->idVendor && id->idProduct)
         uvc_trace(UVC_TRACE_PROBE, "Probing known UVC device %s "
@@ -1538,6 +2118,9 @@ static int uvc_probe(struct usb_interface *intf,
     if ((dev = kzalloc(sizeof *dev, GFP_KERNEL)) == NULL)
         return -ENOMEM;
 
+    dev->probe_start_ns = ktime_get_ns();
+    init_completion(&dev->probe_done);
+    mutex_init(&dev->lock);
     dev->udev = usb_get_dev(udev);
 
     dev->intf = usb_get_intf(intf);
@@ -1553,17 +2136,20 @@ static int uvc_probe(struct usb_interface *intf,
                 le16_to_cpu(udev->descriptor.idVendor),
                 le16_to_cpu(udev->descriptor.idProduct));
 
+    uvc_probe_cache_key(dev);
+
     if (intf->intf_assoc && intf->intf_assoc->iFunction != 0)
         function = intf->intf_assoc->iFunction;
     else
         function = intf->cur_altsetting->desc.iInterface;
-    if (function != 0) {
+    if (function != 0 && !uvc_probe_cache_get_name(dev)) {
         size_t len;
 
         strlcat(dev->name, ": ", sizeof(dev->name));
         len = strlen(dev->name);
         usb_string(udev, function, dev->name + len,
                 sizeof(dev->name) - len);
+        uvc_probe_cache_put_name(dev);
     }
 
     /* Parse the Video Class control descriptor. */
@@ -1587,30 +2173,19 @@ static int uvc_probe(struct usb_interface *intf,
     }
 
 
-    /* Initialize controls. */
-    if (uvc_ctrl_init_device(dev) < 0)
-        goto error;
-
-    /* Scan the device for video chains. */
-    if (uvc_scan_device(dev) < 0)
-        goto error;
-
-    /* Register video device nodes. */
-    if (uvc_register_chains(dev) < 0)
-        goto error;
-
     /* Save our data pointer in the interface data. */
     usb_set_intfdata(intf, dev);
 
-    /* Initialize the interrupt URB. */
-    if ((ret = uvc_status_init(dev)) < 0) {
-        uvc_printk(KERN_INFO, "Unable to initialize the status "
-                "endpoint (%d), status interrupt will not be "
-                "supported.\n", ret);
-    }
+    dev->probe_sync_ns = ktime_get_ns() - dev->probe_start_ns;
+
+    /* Initialize and register the device asynchronously, or synchronously
+     * if asynchronous probing is disabled.
+     */
+    if (uvc_async_probe_param)
+        async_schedule(uvc_probe_async, dev);
+    else
+        uvc_probe_async(dev, 0);
 
-    uvc_trace(UVC_TRACE_PROBE, "UVC device initialized.\n");
-    usb_enable_autosuspend(udev);
     return 0;
 
 error:
@@ -1632,6 +2207,7 @@ static void uvc_disconnect(struct usb_interface *intf)
             UVC_SC_VIDEOSTREAMING)
         return;
 
+    uvc_probe_wait(dev);
     uvc_unregister_video(dev);
 }
 
@@ -1644,6 +2220,8 @@ static int uvc_suspend(struct usb_interface *intf, pm_message_t message)
     uvc_trace(UVC_TRACE_SUSPEND, "Suspending interface %u\n",
             intf->cur_altsetting->desc.bInterfaceNumber);
 
+    uvc_probe_wait(dev);
+
     /* Controls are cached on the fly so they don't need to be saved. */
     if (intf->cur_altsetting->desc.bInterfaceSubClass ==
             UVC_SC_VIDEOCONTROL) {
@@ -1674,6 +2252,8 @@ static int __uvc_resume(struct usb_interface *intf, int reset)
     uvc_trace(UVC_TRACE_SUSPEND, "Resuming interface %u\n",
             intf->cur_altsetting->desc.bInterfaceNumber);
 
+    uvc_probe_wait(dev);
+
     if (intf->cur_altsetting->desc.bInterfaceSubClass ==
             UVC_SC_VIDEOCONTROL) {
         if (reset) {
@@ -1757,6 +2337,21 @@ module_param_named(trace, uvc_trace_param, uint, S_IRUGO|S_IWUSR);
 MODULE_PARM_DESC(trace, "Trace level bitmask");
 module_param_named(timeout, uvc_timeout_param, uint, S_IRUGO|S_IWUSR);
 MODULE_PARM_DESC(timeout, "Streaming control requests timeout");
+module_param_named(probe_cache, uvc_probe_cache_param, uint, S_IRUGO|S_IWUSR);
+MODULE_PARM_DESC(probe_cache, "Cache probe results across reconnects");
+module_param_named(async_probe, uvc_async_probe_param, uint, S_IRUGO|S_IWUSR);
+MODULE_PARM_DESC(async_probe, "Initialize devices asynchronously");
+module_param_named(nal, uvc_nal_param, uint, S_IRUGO|S_IWUSR);
+MODULE_PARM_DESC(nal, "Deliver H.264/H.265 streams per NAL unit "
+		"(requires an in-kernel NAL consumer)");
+module_param_named(pacing, uvc_pacing_param, uint, S_IRUGO|S_IWUSR);
+MODULE_PARM_DESC(pacing, "Pace output streams at the frame interval");
+module_param_named(standby, uvc_standby_param, uint, S_IRUGO|S_IWUSR);
+MODULE_PARM_DESC(standby, "Keep capture URBs allocated while stopped");
+module_param_named(fast_sync, uvc_fast_sync_param, uint, S_IRUGO|S_IWUSR);
+MODULE_PARM_DESC(fast_sync, "Accept the first frame when its start is received");
+module_param_named(mjpeg_check, uvc_mjpeg_check_param, uint, S_IRUGO|S_IWUSR);
+MODULE_PARM_DESC(mjpeg_check, "MJPEG frames check (0: off, 1: SOI/EOI, 2: markers)");
 
 /* ------------------------------------------------------------------------
  * Driver initialization and cleanup
@@ -1795,39 +2390,18 @@ static int __init uvc_init(void)
 
     uvc_debugfs_init();
 
+    ret = uvc_events_init();
+    if (ret < 0)
+        uvc_printk(KERN_INFO, "Unable to register the status events "
+                "device (%d).\n", ret);
+
     ret = usb_register(&uvc_driver.driver);
     if (ret < 0) {
+        uvc_events_cleanup();
         uvc_debugfs_cleanup();
         return ret;
     }
 
-
-/*iadd
-    ret = alloc_chrdev_region(&dev.devno,1,1,DEV_NAME);
-    if(ret <0)
-        return -ENODEV;
-
-    dev.cdev = cdev_alloc();
-    dev.cdev->ops = &my_fops;
-    cdev_add(dev.cdev,dev.devno,1);
-
-    dev.dev_class = class_create(THIS_MODULE , DEV_NAME);
-    if(IS_ERR(dev.dev_class))
-    {
-        unregister_chrdev_region(dev.devno,1);
-        return PTR_ERR(dev.dev_class);
-    }
-
-
-    dev.device = device_create(dev.dev_class,NULL,dev.devno,NULL,DEV_NAME);
-
-    if (IS_ERR(dev.device))
-    {
-        class_destroy(dev.class);
-        unregister_chrdev_region(dev.devno, 1);
-        return PTR_ERR(dev.device);
-    }
-*/
     printk(KERN_INFO DRIVER_DESC " (" DRIVER_VERSION ")\n");
     return 0;
 }
@@ -1835,15 +2409,9 @@ static int __init uvc_init(void)
 static void __exit uvc_cleanup(void)
 {
     usb_deregister(&uvc_driver.driver);
+    uvc_probe_cache_cleanup();
+    uvc_events_cleanup();
     uvc_debugfs_cleanup();
-
-    /*device_destroy(dev.class,dev.devno);
-    class_destroy(dev.class);
-
-    cdev_del(dev.cdev);
-    unregister_chrdev_region(dev.devno,1);
-*/
-
 }
 
 module_init(uvc_init);
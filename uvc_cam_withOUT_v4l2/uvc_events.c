@@ -0,0 +1,369 @@
+/*
+ *      uvc_events.c  --  USB Video Class driver - Status events device
+ *
+ *      This program is free software; you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation; either version 2 of the License, or
+ *      (at your option) any later version.
+ *
+ */
+
+#include <linux/cdev.h>
+#include <linux/device.h>
+#include <linux/fs.h>
+#include <linux/idr.h>
+#include <linux/kfifo.h>
+#include <linux/kref.h>
+#include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/poll.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+#include <linux/usb.h>
+#include <linux/wait.h>
+
+#include "uvcvideo.h"
+
+/* --------------------------------------------------------------------------
+ * Events ring
+ *
+ * Status packets received on the interrupt endpoint are timestamped and
+ * pushed to a per-device ring, exposed to userspace as a /dev/uvceventN
+ * character device supporting read() and poll(). The status work handler
+ * is the only producer and readers are serialized by the ring lock, so the
+ * kfifo itself needs no locking.
+ *
+ * The ring has its own lifetime: open files keep it alive after the device
+ * has been disconnected, in which case reads return -ENODEV once the ring
+ * has been drained.
+ */
+
+#define UVC_EVENTS_MINORS	64
+#define UVC_EVENTS_RING_SIZE	64	/* Must be a power of 2 */
+
+struct uvc_events {
+	struct kref ref;
+	struct uvc_device *dev;		/* NULL when disconnected */
+	struct mutex lock;		/* Protects dev and serializes readers */
+
+	DECLARE_KFIFO(fifo, struct uvc_status_event, UVC_EVENTS_RING_SIZE);
+	wait_queue_head_t wait;
+	unsigned int dropped;		/* Producer only */
+
+	struct cdev *cdev;
+	int minor;
+};
+
+static dev_t uvc_events_devt;
+static struct class *uvc_events_class;
+static DEFINE_IDR(uvc_events_idr);
+static DEFINE_MUTEX(uvc_events_idr_lock);
+
+static void uvc_events_release_ring(struct kref *kref)
+{
+	struct uvc_events *events = container_of(kref, struct uvc_events, ref);
+
+	kfree(events);
+}
+
+/*
+ * Queue a status packet received at 'timestamp'. Called from the status work
+ * handler, never sleeps. The packet is dropped if the ring is full, the drop
+ * count is reported with the next queued event.
+ */
+void uvc_events_queue(struct uvc_device *dev, const __u8 *data, int len,
+	u64 timestamp)
+{
+	struct uvc_events *events = dev->events;
+	struct uvc_status_event event;
+
+	if (events == NULL)
+		return;
+
+	memset(&event, 0, sizeof(event));
+	event.timestamp = timestamp;
+	event.dropped = events->dropped;
+	event.length = min_t(int, len, sizeof(event.data));
+	memcpy(event.data, data, event.length);
+
+	if (!kfifo_put(&events->fifo, event)) {
+		events->dropped++;
+		return;
+	}
+
+	events->dropped = 0;
+	wake_up_interruptible(&events->wait);
+}
+
+/* --------------------------------------------------------------------------
+ * File operations
+ */
+
+static int uvc_events_open(struct inode *inode, struct file *file)
+{
+	struct uvc_events *events;
+	struct uvc_device *dev;
+	int ret = 0;
+
+	mutex_lock(&uvc_events_idr_lock);
+	events = idr_find(&uvc_events_idr, iminor(inode));
+	if (events != NULL)
+		kref_get(&events->ref);
+	mutex_unlock(&uvc_events_idr_lock);
+
+	if (events == NULL)
+		return -ENODEV;
+
+	mutex_lock(&events->lock);
+	dev = events->dev;
+	if (dev == NULL) {
+		ret = -ENODEV;
+		goto done;
+	}
+
+	ret = usb_autopm_get_interface(dev->intf);
+	if (ret < 0)
+		goto done;
+
+	/* Start the status endpoint for the first user. */
+	mutex_lock(&dev->lock);
+	if (dev->users == 0) {
+		ret = uvc_status_start(dev, GFP_KERNEL);
+		if (ret < 0)
+			usb_autopm_put_interface(dev->intf);
+	}
+	if (ret == 0)
+		dev->users++;
+	mutex_unlock(&dev->lock);
+
+done:
+	mutex_unlock(&events->lock);
+
+	if (ret < 0) {
+		kref_put(&events->ref, uvc_events_release_ring);
+		return ret;
+	}
+
+	file->private_data = events;
+	return nonseekable_open(inode, file);
+}
+
+static int uvc_events_release(struct inode *inode, struct file *file)
+{
+	struct uvc_events *events = file->private_data;
+	struct uvc_device *dev;
+
+	mutex_lock(&events->lock);
+	dev = events->dev;
+	if (dev != NULL) {
+		mutex_lock(&dev->lock);
+		if (--dev->users == 0)
+			uvc_status_stop(dev);
+		mutex_unlock(&dev->lock);
+
+		usb_autopm_put_interface(dev->intf);
+	}
+	mutex_unlock(&events->lock);
+
+	kref_put(&events->ref, uvc_events_release_ring);
+	return 0;
+}
+
+static ssize_t uvc_events_read(struct file *file, char __user *buf,
+	size_t count, loff_t *ppos)
+{
+	struct uvc_events *events = file->private_data;
+	unsigned int copied;
+	int ret;
+
+	if (count < sizeof(struct uvc_status_event))
+		return -EINVAL;
+
+	if (mutex_lock_interruptible(&events->lock))
+		return -ERESTARTSYS;
+
+	while (kfifo_is_empty(&events->fifo)) {
+		if (events->dev == NULL) {
+			ret = -ENODEV;
+			goto done;
+		}
+
+		if (file->f_flags & O_NONBLOCK) {
+			ret = -EAGAIN;
+			goto done;
+		}
+
+		mutex_unlock(&events->lock);
+
+		ret = wait_event_interruptible(events->wait,
+			!kfifo_is_empty(&events->fifo) ||
+			READ_ONCE(events->dev) == NULL);
+		if (ret < 0)
+			return ret;
+
+		if (mutex_lock_interruptible(&events->lock))
+			return -ERESTARTSYS;
+	}
+
+	/* Only copy whole events. */
+	count = rounddown(count, sizeof(struct uvc_status_event));
+	ret = kfifo_to_user(&events->fifo, buf, count, &copied);
+	if (ret == 0)
+		ret = copied;
+
+done:
+	mutex_unlock(&events->lock);
+	return ret;
+}
+
+static unsigned int uvc_events_poll(struct file *file, poll_table *wait)
+{
+	struct uvc_events *events = file->private_data;
+
+	poll_wait(file, &events->wait, wait);
+
+	if (!kfifo_is_empty(&events->fifo))
+		return POLLIN | POLLRDNORM;
+
+	if (READ_ONCE(events->dev) == NULL)
+		return POLLHUP | POLLERR;
+
+	return 0;
+}
+
+static const struct file_operations uvc_events_fops = {
+	.owner		= THIS_MODULE,
+	.open		= uvc_events_open,
+	.release	= uvc_events_release,
+	.read		= uvc_events_read,
+	.poll		= uvc_events_poll,
+	.llseek		= no_llseek,
+};
+
+/* --------------------------------------------------------------------------
+ * Device registration
+ */
+
+int uvc_events_init_device(struct uvc_device *dev)
+{
+	struct uvc_events *events;
+	struct device *device;
+	dev_t devt;
+	int ret;
+
+	if (uvc_events_class == NULL)
+		return 0;
+
+	events = kzalloc(sizeof(*events), GFP_KERNEL);
+	if (events == NULL)
+		return -ENOMEM;
+
+	kref_init(&events->ref);
+	mutex_init(&events->lock);
+	INIT_KFIFO(events->fifo);
+	init_waitqueue_head(&events->wait);
+	events->dev = dev;
+
+	mutex_lock(&uvc_events_idr_lock);
+	ret = idr_alloc(&uvc_events_idr, events, 0, UVC_EVENTS_MINORS,
+			GFP_KERNEL);
+	mutex_unlock(&uvc_events_idr_lock);
+	if (ret < 0)
+		goto error;
+
+	events->minor = ret;
+	devt = MKDEV(MAJOR(uvc_events_devt), events->minor);
+
+	events->cdev = cdev_alloc();
+	if (events->cdev == NULL) {
+		ret = -ENOMEM;
+		goto error_idr;
+	}
+
+	events->cdev->owner = THIS_MODULE;
+	events->cdev->ops = &uvc_events_fops;
+
+	ret = cdev_add(events->cdev, devt, 1);
+	if (ret < 0) {
+		kobject_put(&events->cdev->kobj);
+		goto error_idr;
+	}
+
+	device = device_create(uvc_events_class, &dev->intf->dev, devt,
+			       NULL, "uvcevent%d", events->minor);
+	if (IS_ERR(device)) {
+		ret = PTR_ERR(device);
+		cdev_del(events->cdev);
+		goto error_idr;
+	}
+
+	dev->events = events;
+	return 0;
+
+error_idr:
+	mutex_lock(&uvc_events_idr_lock);
+	idr_remove(&uvc_events_idr, events->minor);
+	mutex_unlock(&uvc_events_idr_lock);
+error:
+	kfree(events);
+	return ret;
+}
+
+/*
+ * Must be called after the status URBs have been killed and the status work
+ * cancelled, as the work handler accesses the ring without locking.
+ */
+void uvc_events_cleanup_device(struct uvc_device *dev)
+{
+	struct uvc_events *events = dev->events;
+
+	if (events == NULL)
+		return;
+
+	mutex_lock(&uvc_events_idr_lock);
+	idr_remove(&uvc_events_idr, events->minor);
+	mutex_unlock(&uvc_events_idr_lock);
+
+	device_destroy(uvc_events_class,
+		       MKDEV(MAJOR(uvc_events_devt), events->minor));
+	cdev_del(events->cdev);
+
+	/* Detach open files from the device and wake up blocked readers. */
+	mutex_lock(&events->lock);
+	WRITE_ONCE(events->dev, NULL);
+	mutex_unlock(&events->lock);
+	wake_up_interruptible(&events->wait);
+
+	dev->events = NULL;
+	kref_put(&events->ref, uvc_events_release_ring);
+}
+
+int uvc_events_init(void)
+{
+	struct class *class;
+	int ret;
+
+	ret = alloc_chrdev_region(&uvc_events_devt, 0, UVC_EVENTS_MINORS,
+				  "uvcevent");
+	if (ret < 0)
+		return ret;
+
+	class = class_create(THIS_MODULE, "uvcevent");
+	if (IS_ERR(class)) {
+		unregister_chrdev_region(uvc_events_devt, UVC_EVENTS_MINORS);
+		return PTR_ERR(class);
+	}
+
+	uvc_events_class = class;
+	return 0;
+}
+
+void uvc_events_cleanup(void)
+{
+	if (uvc_events_class == NULL)
+		return;
+
+	class_destroy(uvc_events_class);
+	unregister_chrdev_region(uvc_events_devt, UVC_EVENTS_MINORS);
+	idr_destroy(&uvc_events_idr);
+}
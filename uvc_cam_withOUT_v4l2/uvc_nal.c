@@ -0,0 +1,520 @@
+/*
+ *      uvc_nal.c  --  USB Video Class driver - NAL unit streaming
+ *
+ *      This program is free software; you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation; either version 2 of the License, or
+ *      (at your option) any later version.
+ *
+ */
+
+#include <linux/kernel.h>
+#include <linux/list.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/timekeeping.h>
+#include <linux/usb.h>
+#include <linux/wait.h>
+
+#include "uvcvideo.h"
+
+/* --------------------------------------------------------------------------
+ * NAL streaming
+ *
+ * Frame based H.264 and H.265 streams are Annex B byte streams, with NAL
+ * units separated by 0x000001 start codes. In NAL streaming mode the payload
+ * data is scanned for start codes as it arrives, and every NAL unit is handed
+ * to the consumer as soon as the next start code (or the end of the frame)
+ * is seen, instead of waiting for the whole frame to be received.
+ *
+ * NAL units are stored in chains of fixed-size chunks taken from a per-stream
+ * pool preallocated when the stream is initialized, so no memory is allocated
+ * in the URB completion handler. When the pool runs dry the NAL unit being
+ * received is dropped.
+ *
+ * The scanner state is only accessed by the URB completion handler. The pool
+ * and the ready list are protected by the queue spinlock.
+ */
+
+struct uvc_nal_queue {
+	spinlock_t lock;		/* Protects the lists below */
+	struct list_head free_chunks;
+	struct list_head free_units;
+	struct list_head ready;
+	wait_queue_head_t wait;
+
+	/* Scanner state. */
+	struct uvc_nal *cur;		/* NAL unit being received */
+	unsigned int zeros;		/* Pending zero bytes */
+
+	/* Statistics. */
+	unsigned int nb_units;
+	unsigned int nb_dropped;
+};
+
+static const __u8 uvc_nal_zeros[8];
+
+static struct uvc_nal_chunk *uvc_nal_get_chunk(struct uvc_nal_queue *queue)
+{
+	struct uvc_nal_chunk *chunk = NULL;
+	unsigned long flags;
+
+	spin_lock_irqsave(&queue->lock, flags);
+	if (!list_empty(&queue->free_chunks)) {
+		chunk = list_first_entry(&queue->free_chunks,
+					 struct uvc_nal_chunk, list);
+		list_del(&chunk->list);
+	}
+	spin_unlock_irqrestore(&queue->lock, flags);
+
+	return chunk;
+}
+
+static void __uvc_nal_put(struct uvc_nal_queue *queue, struct uvc_nal *nal)
+{
+	list_splice_init(&nal->chunks, &queue->free_chunks);
+	list_add_tail(&nal->list, &queue->free_units);
+}
+
+static void uvc_nal_put(struct uvc_nal_queue *queue, struct uvc_nal *nal)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&queue->lock, flags);
+	__uvc_nal_put(queue, nal);
+	spin_unlock_irqrestore(&queue->lock, flags);
+}
+
+/*
+ * Append data to the NAL unit being received. Data is discarded when no NAL
+ * unit is in progress, which happens before the first start code of a frame
+ * and after running out of NAL units.
+ */
+static void uvc_nal_append(struct uvc_nal_queue *queue, const __u8 *data,
+	unsigned int len)
+{
+	struct uvc_nal *nal = queue->cur;
+	struct uvc_nal_chunk *chunk;
+	unsigned int nbytes;
+
+	if (nal == NULL || nal->error)
+		return;
+
+	while (len) {
+		chunk = list_empty(&nal->chunks) ? NULL
+		      : list_last_entry(&nal->chunks, struct uvc_nal_chunk, list);
+
+		if (chunk == NULL || chunk->size == UVC_NAL_CHUNK_SIZE) {
+			chunk = uvc_nal_get_chunk(queue);
+			if (chunk == NULL) {
+				uvc_trace(UVC_TRACE_FRAME, "NAL chunk pool "
+					  "exhausted, dropping NAL unit.\n");
+				nal->error = 1;
+				return;
+			}
+
+			chunk->size = 0;
+			list_add_tail(&chunk->list, &nal->chunks);
+		}
+
+		nbytes = min(len, UVC_NAL_CHUNK_SIZE - chunk->size);
+		memcpy(chunk->data + chunk->size, data, nbytes);
+		chunk->size += nbytes;
+		nal->size += nbytes;
+		data += nbytes;
+		len -= nbytes;
+	}
+}
+
+/* Zero bytes that turned out not to be part of a start code are data. */
+static void uvc_nal_flush_zeros(struct uvc_nal_queue *queue)
+{
+	unsigned int nbytes;
+
+	while (queue->zeros) {
+		nbytes = min_t(unsigned int, queue->zeros,
+			       sizeof(uvc_nal_zeros));
+		uvc_nal_append(queue, uvc_nal_zeros, nbytes);
+		queue->zeros -= nbytes;
+	}
+}
+
+/*
+ * Complete the NAL unit being received and hand it to the consumer. Empty
+ * and corrupted NAL units are dropped.
+ */
+static void uvc_nal_complete(struct uvc_streaming *stream, int end_of_frame)
+{
+	struct uvc_nal_queue *queue = stream->nal;
+	struct uvc_nal *nal = queue->cur;
+	unsigned long flags;
+
+	if (nal == NULL)
+		return;
+
+	queue->cur = NULL;
+
+	if (nal->error || nal->size == 0) {
+		if (nal->size)
+			queue->nb_dropped++;
+		uvc_nal_put(queue, nal);
+		return;
+	}
+
+	nal->end_of_frame = end_of_frame;
+	nal->sequence = stream->sequence;
+	nal->timestamp = ktime_get_ns();
+
+	spin_lock_irqsave(&queue->lock, flags);
+	list_add_tail(&nal->list, &queue->ready);
+	spin_unlock_irqrestore(&queue->lock, flags);
+
+	queue->nb_units++;
+	wake_up(&queue->wait);
+}
+
+/* A start code has been found, complete the current NAL unit and start the
+ * next one.
+ */
+static void uvc_nal_begin(struct uvc_streaming *stream)
+{
+	struct uvc_nal_queue *queue = stream->nal;
+	struct uvc_nal *nal = NULL;
+	unsigned long flags;
+
+	uvc_nal_complete(stream, 0);
+
+	spin_lock_irqsave(&queue->lock, flags);
+	if (!list_empty(&queue->free_units)) {
+		nal = list_first_entry(&queue->free_units, struct uvc_nal,
+				       list);
+		list_del(&nal->list);
+	}
+	spin_unlock_irqrestore(&queue->lock, flags);
+
+	if (nal == NULL) {
+		uvc_trace(UVC_TRACE_FRAME, "No free NAL unit, dropping.\n");
+		queue->nb_dropped++;
+		return;
+	}
+
+	INIT_LIST_HEAD(&nal->chunks);
+	nal->size = 0;
+	nal->error = 0;
+	queue->cur = nal;
+}
+
+static void uvc_nal_end_frame(struct uvc_streaming *stream)
+{
+	/* Trailing zero bytes belong to the byte stream, not to the NAL. */
+	stream->nal->zeros = 0;
+	uvc_nal_complete(stream, 1);
+}
+
+/*
+ * Scan payload data for start codes. Runs of data without any zero byte are
+ * copied in one go, zero bytes are held back until the byte that ends the run
+ * tells whether they form a start code.
+ */
+static void uvc_nal_scan(struct uvc_streaming *stream, const __u8 *data,
+	unsigned int len)
+{
+	struct uvc_nal_queue *queue = stream->nal;
+	const __u8 *zero;
+	unsigned int nbytes;
+
+	while (len) {
+		if (queue->zeros) {
+			if (*data == 0x00) {
+				queue->zeros++;
+				data++;
+				len--;
+				continue;
+			}
+
+			if (*data == 0x01 && queue->zeros >= 2) {
+				queue->zeros = 0;
+				uvc_nal_begin(stream);
+				data++;
+				len--;
+				continue;
+			}
+
+			uvc_nal_flush_zeros(queue);
+		}
+
+		zero = memchr(data, 0x00, len);
+		nbytes = zero ? zero - data : len;
+		uvc_nal_append(queue, data, nbytes);
+		data += nbytes;
+		len -= nbytes;
+
+		if (zero) {
+			queue->zeros = 1;
+			data++;
+			len--;
+		}
+	}
+}
+
+/* --------------------------------------------------------------------------
+ * Payload decoding
+ */
+
+/*
+ * Process a payload header. Return the header length, or a negative error
+ * code if the payload must be skipped.
+ */
+static int uvc_nal_decode_header(struct uvc_streaming *stream,
+	const __u8 *data, int len)
+{
+	__u8 fid;
+
+	if (len < 2 || data[0] < 2 || data[0] > len) {
+		stream->stats.frame.nb_invalid++;
+		return -EINVAL;
+	}
+
+	fid = data[1] & UVC_STREAM_FID;
+	if (fid != stream->last_fid) {
+		stream->sequence++;
+		uvc_nal_end_frame(stream);
+		stream->last_fid = fid;
+	}
+
+	if ((data[1] & UVC_STREAM_ERR) && stream->nal->cur)
+		stream->nal->cur->error = 1;
+
+	return data[0];
+}
+
+static void uvc_nal_decode_end(struct uvc_streaming *stream,
+	const __u8 *data)
+{
+	if (!(data[1] & UVC_STREAM_EOF))
+		return;
+
+	uvc_nal_end_frame(stream);
+	if (stream->dev->quirks & UVC_QUIRK_STREAM_NO_FID)
+		stream->last_fid ^= UVC_STREAM_FID;
+}
+
+static void uvc_nal_decode_isoc(struct urb *urb, struct uvc_streaming *stream)
+{
+	unsigned int len;
+	u8 *mem;
+	int ret, i;
+
+	for (i = 0; i < urb->number_of_packets; ++i) {
+		if (urb->iso_frame_desc[i].status < 0) {
+			if (stream->nal->cur)
+				stream->nal->cur->error = 1;
+			continue;
+		}
+
+		mem = urb->transfer_buffer + urb->iso_frame_desc[i].offset;
+		len = urb->iso_frame_desc[i].actual_length;
+
+		ret = uvc_nal_decode_header(stream, mem, len);
+		if (ret < 0)
+			continue;
+
+		uvc_nal_scan(stream, mem + ret, len - ret);
+		uvc_nal_decode_end(stream, mem);
+	}
+}
+
+static void uvc_nal_decode_bulk(struct urb *urb, struct uvc_streaming *stream)
+{
+	u8 *mem = urb->transfer_buffer;
+	int len = urb->actual_length;
+	int ret;
+
+	if (len == 0 && stream->bulk.header_size == 0)
+		return;
+
+	stream->bulk.payload_size += len;
+
+	/* The first URB of a payload carries the header. */
+	if (stream->bulk.header_size == 0 && !stream->bulk.skip_payload) {
+		ret = uvc_nal_decode_header(stream, mem, len);
+		if (ret < 0) {
+			stream->bulk.skip_payload = 1;
+		} else {
+			memcpy(stream->bulk.header, mem, ret);
+			stream->bulk.header_size = ret;
+			mem += ret;
+			len -= ret;
+		}
+	}
+
+	if (!stream->bulk.skip_payload)
+		uvc_nal_scan(stream, mem, len);
+
+	if (urb->actual_length < urb->transfer_buffer_length ||
+	    stream->bulk.payload_size >= stream->bulk.max_payload_size) {
+		if (!stream->bulk.skip_payload)
+			uvc_nal_decode_end(stream, stream->bulk.header);
+
+		stream->bulk.header_size = 0;
+		stream->bulk.skip_payload = 0;
+		stream->bulk.payload_size = 0;
+	}
+}
+
+/*
+ * Decode a completed URB in NAL streaming mode. Called from the URB
+ * completion handler in place of the frame based decoding functions.
+ */
+void uvc_nal_decode(struct urb *urb, struct uvc_streaming *stream)
+{
+	if (usb_pipeisoc(urb->pipe))
+		uvc_nal_decode_isoc(urb, stream);
+	else
+		uvc_nal_decode_bulk(urb, stream);
+}
+
+/* --------------------------------------------------------------------------
+ * Consumer API
+ *
+ * NAL units have no userspace interface, they are consumed in the kernel
+ * through the functions below. Units that are never dequeued and released
+ * stay out of the pool, so NAL streaming requires a consumer.
+ */
+
+/*
+ * Wait up to 'timeout' jiffies for a NAL unit. Return the oldest completed
+ * NAL unit, or NULL on timeout or signal. The caller owns the NAL unit until
+ * it calls uvc_nal_release().
+ */
+struct uvc_nal *uvc_nal_dequeue(struct uvc_streaming *stream, long timeout)
+{
+	struct uvc_nal_queue *queue = stream->nal;
+	struct uvc_nal *nal = NULL;
+	unsigned long flags;
+
+	if (queue == NULL)
+		return NULL;
+
+	if (wait_event_interruptible_timeout(queue->wait,
+			!list_empty(&queue->ready), timeout) <= 0)
+		return NULL;
+
+	spin_lock_irqsave(&queue->lock, flags);
+	if (!list_empty(&queue->ready)) {
+		nal = list_first_entry(&queue->ready, struct uvc_nal, list);
+		list_del(&nal->list);
+	}
+	spin_unlock_irqrestore(&queue->lock, flags);
+
+	return nal;
+}
+
+void uvc_nal_release(struct uvc_streaming *stream, struct uvc_nal *nal)
+{
+	uvc_nal_put(stream->nal, nal);
+}
+
+/* --------------------------------------------------------------------------
+ * Initialization and cleanup
+ */
+
+bool uvc_nal_format(const struct uvc_format *format)
+{
+	return format->type == UVC_VS_FORMAT_FRAME_BASED &&
+	       (format->fcc == VIDEO_PIX_FMT_H264 ||
+		format->fcc == VIDEO_PIX_FMT_HEVC);
+}
+
+/*
+ * Reset the scanner when streaming starts, dropping the NAL unit that was
+ * being received when the stream was stopped. Completed NAL units are kept
+ * for the consumer.
+ */
+void uvc_nal_start(struct uvc_streaming *stream)
+{
+	struct uvc_nal_queue *queue = stream->nal;
+
+	if (queue->cur) {
+		uvc_nal_put(queue, queue->cur);
+		queue->cur = NULL;
+	}
+
+	queue->zeros = 0;
+}
+
+static void uvc_nal_free(struct uvc_nal_queue *queue)
+{
+	struct uvc_nal_chunk *chunk, *next_chunk;
+	struct uvc_nal *nal, *next;
+
+	list_for_each_entry_safe(nal, next, &queue->ready, list)
+		__uvc_nal_put(queue, nal);
+
+	list_for_each_entry_safe(chunk, next_chunk, &queue->free_chunks, list)
+		kfree(chunk);
+
+	list_for_each_entry_safe(nal, next, &queue->free_units, list)
+		kfree(nal);
+
+	kfree(queue);
+}
+
+int uvc_nal_init(struct uvc_streaming *stream)
+{
+	struct uvc_nal_queue *queue;
+	struct uvc_nal_chunk *chunk;
+	struct uvc_nal *nal;
+	unsigned int i;
+
+	queue = kzalloc(sizeof(*queue), GFP_KERNEL);
+	if (queue == NULL)
+		return -ENOMEM;
+
+	spin_lock_init(&queue->lock);
+	INIT_LIST_HEAD(&queue->free_chunks);
+	INIT_LIST_HEAD(&queue->free_units);
+	INIT_LIST_HEAD(&queue->ready);
+	init_waitqueue_head(&queue->wait);
+
+	for (i = 0; i < UVC_NAL_CHUNKS; ++i) {
+		chunk = kmalloc(sizeof(*chunk), GFP_KERNEL);
+		if (chunk == NULL)
+			goto error;
+		list_add_tail(&chunk->list, &queue->free_chunks);
+	}
+
+	for (i = 0; i < UVC_NAL_UNITS; ++i) {
+		nal = kzalloc(sizeof(*nal), GFP_KERNEL);
+		if (nal == NULL)
+			goto error;
+		INIT_LIST_HEAD(&nal->chunks);
+		list_add_tail(&nal->list, &queue->free_units);
+	}
+
+	stream->nal = queue;
+	return 0;
+
+error:
+	uvc_nal_free(queue);
+	return -ENOMEM;
+}
+
+/*
+ * Must be called once the stream has been stopped and all consumers have
+ * released their NAL units.
+ */
+void uvc_nal_cleanup(struct uvc_streaming *stream)
+{
+	struct uvc_nal_queue *queue = stream->nal;
+
+	if (queue == NULL)
+		return;
+
+	if (queue->cur)
+		__uvc_nal_put(queue, queue->cur);
+
+	stream->nal = NULL;
+	uvc_nal_free(queue);
+}
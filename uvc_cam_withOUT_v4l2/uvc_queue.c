@@ -22,6 +22,7 @@
 #include <linux/wait.h>
 
 #include "uvcvideo.h"
+#include "uvc_trace.h"
 
 
 // complete
@@ -48,12 +49,52 @@ int uvc_queue_init(struct uvc_video_queue *queue, enum video_buf_type type,
 	mutex_init(&queue->mutex);
 	spin_lock_init(&queue->irqlock);
 	INIT_LIST_HEAD(&queue->irqqueue);
-	queue->flags = drop_corrupted ? UVC_QUEUE_DROP_CORRUPTED : 0;
+	init_waitqueue_head(&queue->progress_wait);
+	queue->flags = 0;
+	queue->policy = drop_corrupted ? UVC_FRAME_POLICY_DROP
+				       : UVC_FRAME_POLICY_DELIVER;
 
 	return 0;
 }
 
 
+/*
+ * Queue a buffer for transfer. Capture buffers are filled by the decode path,
+ * output buffers must have bytesused set to the frame size.
+ */
+int uvc_queue_buffer(struct uvc_video_queue *queue, struct uvc_buffer *buf)
+{
+	unsigned long flags;
+	int ret = 0;
+
+	spin_lock_irqsave(&queue->irqlock, flags);
+	if (queue->flags & UVC_QUEUE_DISCONNECTED) {
+		ret = -ENODEV;
+	} else {
+		buf->state = UVC_BUF_STATE_QUEUED;
+		buf->error = 0;
+		buf->progress = 0;
+		buf->duplicate = 0;
+		memset(&buf->loss, 0, sizeof(buf->loss));
+		list_add_tail(&buf->queue, &queue->irqqueue);
+	}
+	spin_unlock_irqrestore(&queue->irqlock, flags);
+
+	return ret;
+}
+
+bool uvc_queue_empty(struct uvc_video_queue *queue)
+{
+	unsigned long flags;
+	bool empty;
+
+	spin_lock_irqsave(&queue->irqlock, flags);
+	empty = list_empty(&queue->irqqueue);
+	spin_unlock_irqrestore(&queue->irqlock, flags);
+
+	return empty;
+}
+
 //complete // from uvc_video 
 void uvc_queue_cancel(struct uvc_video_queue *queue, int disconnect)
 {
@@ -61,11 +102,71 @@ void uvc_queue_cancel(struct uvc_video_queue *queue, int disconnect)
 
 	spin_lock_irqsave(&queue->irqlock, flags);
 	uvc_queue_return_buffers(queue, UVC_BUF_STATE_ERROR);
+	queue->have_good = false;
 	
    if (disconnect)
 		queue->flags |= UVC_QUEUE_DISCONNECTED;
 	spin_unlock_irqrestore(&queue->irqlock, flags);
 }
+/*
+ * Drop a corrupted frame by resetting its buffer in place. The buffer stays
+ * at the head of the queue and is reused for the next frame.
+ */
+static struct uvc_buffer *uvc_queue_recycle(struct uvc_video_queue *queue,
+		struct uvc_buffer *buf)
+{
+	trace_uvc_buffer_drop(container_of(queue, struct uvc_streaming, queue),
+			      buf);
+
+	buf->error = 0;
+	buf->state = UVC_BUF_STATE_QUEUED;
+	buf->bytesused = 0;
+	memset(&buf->loss, 0, sizeof(buf->loss));
+
+	/* Let sub-frame consumers know the frame restarts, if they have seen
+	 * part of it.
+	 */
+	if (buf->progress) {
+		smp_store_release(&buf->progress, 0);
+		wake_up_all(&queue->progress_wait);
+	}
+
+	return buf;
+}
+
+/*
+ * Check whether a corrupted frame only lost a few packets and is worth
+ * delivering. A size mismatch is the expected consequence of lost packets
+ * for uncompressed formats.
+ */
+static bool uvc_queue_loss_acceptable(struct uvc_video_queue *queue,
+		struct uvc_buffer *buf)
+{
+	const u32 causes = UVC_LOSS_USB_STATUS | UVC_LOSS_SIZE;
+
+	return !(buf->loss.causes & ~causes) &&
+	       buf->loss.lost_packets <= READ_ONCE(queue->loss_threshold);
+}
+
+/*
+ * Replace a corrupted frame by a reference to the last good one. The buffer
+ * is delivered without data like a duplicate frame, consumers keep showing
+ * the last good frame they received. This is only possible once a good frame
+ * has been delivered.
+ */
+static bool uvc_queue_repeat(struct uvc_video_queue *queue,
+		struct uvc_buffer *buf)
+{
+	if (!READ_ONCE(queue->have_good))
+		return false;
+
+	buf->bytesused = 0;
+	buf->duplicate = 1;
+	buf->loss.causes |= UVC_LOSS_REPEATED;
+	buf->error = 0;
+	return true;
+}
+
 // complete // from uvc_video
 struct uvc_buffer *uvc_queue_next_buffer(struct uvc_video_queue *queue,
 		struct uvc_buffer *buf)
@@ -73,11 +174,25 @@ struct uvc_buffer *uvc_queue_next_buffer(struct uvc_video_queue *queue,
 	struct uvc_buffer *nextbuf;
 	unsigned long flags;
 
-	if ((queue->flags & UVC_QUEUE_DROP_CORRUPTED) && buf->error) {
-		buf->error = 0;
-		buf->state = UVC_BUF_STATE_QUEUED;
-		buf->bytesused = 0;
-		return buf;
+	if (buf->error) {
+		switch (READ_ONCE(queue->policy)) {
+		case UVC_FRAME_POLICY_DELIVER:
+			break;
+
+		case UVC_FRAME_POLICY_THRESHOLD:
+			if (uvc_queue_loss_acceptable(queue, buf))
+				break;
+			return uvc_queue_recycle(queue, buf);
+
+		case UVC_FRAME_POLICY_REPEAT:
+			if (uvc_queue_repeat(queue, buf))
+				break;
+			return uvc_queue_recycle(queue, buf);
+
+		case UVC_FRAME_POLICY_DROP:
+		default:
+			return uvc_queue_recycle(queue, buf);
+		}
 	}
 
 	spin_lock_irqsave(&queue->irqlock, flags);
@@ -87,9 +202,46 @@ struct uvc_buffer *uvc_queue_next_buffer(struct uvc_video_queue *queue,
 					   queue);
 	else
 		nextbuf = NULL;
+	if (!buf->error && !buf->duplicate)
+		queue->have_good = true;
 	spin_unlock_irqrestore(&queue->irqlock, flags);
 
-	buf->state = buf->error ? UVC_BUF_STATE_ERROR : UVC_BUF_STATE_DONE;
+	smp_store_release(&buf->progress, buf->bytesused);
+	smp_store_release(&buf->state,
+			  buf->error ? UVC_BUF_STATE_ERROR : UVC_BUF_STATE_DONE);
+	wake_up_all(&queue->progress_wait);
 
 	return nextbuf;
 }
+
+/*
+ * Wait until at least 'bytes' bytes of the buffer have been received, or the
+ * buffer has been completed. Return the number of bytes available, which can
+ * go back to 0 if a corrupted frame is dropped and the buffer reused, -EIO if
+ * the buffer completed with an error, or -ETIMEDOUT.
+ *
+ * This is an in-kernel interface for consumers processing frames while they
+ * are received, the driver itself doesn't call it.
+ */
+int uvc_queue_wait_progress(struct uvc_video_queue *queue,
+		struct uvc_buffer *buf, unsigned int bytes, long timeout)
+{
+	enum uvc_buffer_state state;
+	long ret;
+
+	ret = wait_event_interruptible_timeout(queue->progress_wait,
+		smp_load_acquire(&buf->progress) >= bytes ||
+		smp_load_acquire(&buf->state) >= UVC_BUF_STATE_DONE, timeout);
+	if (ret < 0)
+		return ret;
+
+	state = smp_load_acquire(&buf->state);
+	if (state == UVC_BUF_STATE_ERROR)
+		return -EIO;
+
+	if (ret == 0 && state != UVC_BUF_STATE_DONE &&
+	    smp_load_acquire(&buf->progress) < bytes)
+		return -ETIMEDOUT;
+
+	return smp_load_acquire(&buf->progress);
+}
@@ -13,6 +13,7 @@
 
 #include <linux/kernel.h>
 #include <linux/input.h>
+#include <linux/kfifo.h>
 #include <linux/slab.h>
 #include <linux/usb.h>
 #include <linux/usb/input.h>
@@ -90,8 +91,12 @@ static void uvc_input_report_key(struct uvc_device *dev, unsigned int code,
  */
 
 //completed
-static void uvc_event_streaming(struct uvc_device *dev, __u8 *data, int len)
+static void uvc_event_streaming(struct uvc_device *dev,
+	const struct uvc_status_packet *packet, int len)
 {
+	const __u8 *data = packet->data;
+	struct uvc_streaming *stream;
+
 	if (len < 3) {
 		uvc_trace(UVC_TRACE_STATUS, "Invalid streaming status event "
 				"received.\n");
@@ -107,12 +112,25 @@ static void uvc_event_streaming(struct uvc_device *dev, __u8 *data, int len)
 	} else {
 		uvc_trace(UVC_TRACE_STATUS, "Stream %u error event %02x %02x "
 			"len %d.\n", data[1], data[2], data[3], len);
+
+		list_for_each_entry(stream, &dev->streams, list) {
+			if (stream->intfnum == data[1]) {
+				uvc_video_recover(stream,
+						  UVC_RECOVERY_REASON_EVENT);
+				break;
+			}
+		}
 	}
+
+	uvc_events_queue(dev, data, len, packet->timestamp);
 }
 // complete
-static void uvc_event_control(struct uvc_device *dev, __u8 *data, int len)
+static void uvc_event_control(struct uvc_device *dev,
+	const struct uvc_status_packet *packet, int len)
 {
+	const __u8 *data = packet->data;
 	char *attrs[3] = { "value", "info", "failure" };
+	struct uvc_control *ctrl;
 
 	if (len < 6 || data[2] != 0 || data[4] > 2) {
 		uvc_trace(UVC_TRACE_STATUS, "Invalid control status event "
@@ -120,15 +138,62 @@ static void uvc_event_control(struct uvc_device *dev, __u8 *data, int len)
 		return;
 	}
 
+	ctrl = uvc_ctrl_find(dev, data[1], data[3]);
+	if (ctrl == NULL) {
+		uvc_trace(UVC_TRACE_STATUS, "Control %u/%u change event for "
+			"unknown control.\n", data[1], data[3]);
+		return;
+	}
+
 	uvc_trace(UVC_TRACE_STATUS, "Control %u/%u %s change len %d.\n",
 		data[1], data[3], attrs[data[4]], len);
+
+	/* Value changes carry the new value, update the cache. */
+	if (data[4] == 0)
+		uvc_ctrl_status_update(dev, ctrl, data + 5, len - 5);
+
+	uvc_events_queue(dev, data, len, packet->timestamp);
 }
 
 
+/*
+ * Status packets are copied to the packet FIFO by the URB completion handler,
+ * which resubmits the URB immediately, and parsed in process context by the
+ * status work handler. With UVC_STATUS_URBS URBs in flight, packets received
+ * while a previous one is being handled aren't lost. The FIFO is filled in
+ * completion order and drained by a single work item, preserving the order
+ * of events.
+ */
+static void uvc_status_work(struct work_struct *work)
+{
+	struct uvc_device *dev = container_of(work, struct uvc_device,
+					      status_work);
+	struct uvc_status_packet packet;
+
+	while (kfifo_out_spinlocked(&dev->status_fifo, &packet, 1,
+				    &dev->status_lock)) {
+		switch (packet.data[0] & 0x0f) {
+		case UVC_STATUS_TYPE_CONTROL:
+			uvc_event_control(dev, &packet, packet.length);
+			break;
+
+		case UVC_STATUS_TYPE_STREAMING:
+			uvc_event_streaming(dev, &packet, packet.length);
+			break;
+
+		default:
+			uvc_trace(UVC_TRACE_STATUS, "Unknown status event "
+				"type %u.\n", packet.data[0]);
+			break;
+		}
+	}
+}
+
 // completed
 static void uvc_status_complete(struct urb *urb)
 {
 	struct uvc_device *dev = urb->context;
+	struct uvc_status_packet packet;
 	int len, ret;
 
 	switch (urb->status) {
@@ -150,20 +215,16 @@ static void uvc_status_complete(struct urb *urb)
 
 	len = urb->actual_length;
 	if (len > 0) {
-		switch (dev->status[0] & 0x0f) {
-		case UVC_STATUS_TYPE_CONTROL:
-			uvc_event_control(dev, dev->status, len);
-			break;
-
-		case UVC_STATUS_TYPE_STREAMING:
-			uvc_event_streaming(dev, dev->status, len);
-			break;
-
-		default:
-			uvc_trace(UVC_TRACE_STATUS, "Unknown status event "
-				"type %u.\n", dev->status[0]);
-			break;
-		}
+		packet.timestamp = ktime_get_ns();
+		packet.length = len;
+		memcpy(packet.data, urb->transfer_buffer, len);
+
+		if (kfifo_in_spinlocked(&dev->status_fifo, &packet, 1,
+					&dev->status_lock))
+			schedule_work(&dev->status_work);
+		else
+			uvc_trace(UVC_TRACE_STATUS, "Status FIFO full, "
+				"dropping event.\n");
 	}
 
 	/* Resubmit the URB. */
@@ -178,21 +239,30 @@ int uvc_status_init(struct uvc_device *dev)
 {
 	struct usb_host_endpoint *ep = dev->int_ep;
 	unsigned int pipe;
+	unsigned int i;
 	int interval;
+	int ret;
 
 	if (ep == NULL)
 		return 0;
 
 	uvc_input_init(dev);
 
-	dev->status = kzalloc(UVC_MAX_STATUS_SIZE, GFP_KERNEL);
+	spin_lock_init(&dev->status_lock);
+	INIT_KFIFO(dev->status_fifo);
+	INIT_WORK(&dev->status_work, uvc_status_work);
+
+	dev->status = kcalloc(UVC_STATUS_URBS, UVC_MAX_STATUS_SIZE,
+			      GFP_KERNEL);
 	if (dev->status == NULL)
 		return -ENOMEM;
 
-	dev->int_urb = usb_alloc_urb(0, GFP_KERNEL);
-	if (dev->int_urb == NULL) {
-		kfree(dev->status);
-		return -ENOMEM;
+	for (i = 0; i < UVC_STATUS_URBS; ++i) {
+		dev->int_urb[i] = usb_alloc_urb(0, GFP_KERNEL);
+		if (dev->int_urb[i] == NULL) {
+			ret = -ENOMEM;
+			goto error;
+		}
 	}
 
 	pipe = usb_rcvintpipe(dev->udev, ep->desc.bEndpointAddress);
@@ -205,31 +275,79 @@ int uvc_status_init(struct uvc_device *dev)
 	    (dev->quirks & UVC_QUIRK_STATUS_INTERVAL))
 		interval = fls(interval) - 1;
 
-	usb_fill_int_urb(dev->int_urb, dev->udev, pipe,
-		dev->status, UVC_MAX_STATUS_SIZE, uvc_status_complete,
-		dev, interval);
+	for (i = 0; i < UVC_STATUS_URBS; ++i)
+		usb_fill_int_urb(dev->int_urb[i], dev->udev, pipe,
+			dev->status + i * UVC_MAX_STATUS_SIZE,
+			UVC_MAX_STATUS_SIZE, uvc_status_complete,
+			dev, interval);
+
+	ret = uvc_events_init_device(dev);
+	if (ret < 0)
+		uvc_printk(KERN_INFO, "Unable to register the status events "
+			"device (%d).\n", ret);
 
 	return 0;
+
+error:
+	for (i = 0; i < UVC_STATUS_URBS; ++i) {
+		usb_free_urb(dev->int_urb[i]);
+		dev->int_urb[i] = NULL;
+	}
+	kfree(dev->status);
+	dev->status = NULL;
+	return ret;
+}
+
+static void uvc_status_kill_urbs(struct uvc_device *dev)
+{
+	unsigned int i;
+
+	for (i = 0; i < UVC_STATUS_URBS; ++i)
+		usb_kill_urb(dev->int_urb[i]);
 }
+
 // complete // from uvc_driver delete
 void uvc_status_cleanup(struct uvc_device *dev)
 {
-	usb_kill_urb(dev->int_urb);
-	usb_free_urb(dev->int_urb);
+	unsigned int i;
+
+	uvc_status_kill_urbs(dev);
+	if (dev->status_work.func)
+		cancel_work_sync(&dev->status_work);
+	uvc_events_cleanup_device(dev);
+
+	for (i = 0; i < UVC_STATUS_URBS; ++i)
+		usb_free_urb(dev->int_urb[i]);
 	kfree(dev->status);
 	uvc_input_cleanup(dev);
 }
 // complete // from uvc_driver --resume
 int uvc_status_start(struct uvc_device *dev, gfp_t flags)
 {
-	if (dev->int_urb == NULL)
+	unsigned int i;
+	int ret;
+
+	if (dev->int_urb[0] == NULL)
 		return 0;
 
-	return usb_submit_urb(dev->int_urb, flags);
+	for (i = 0; i < UVC_STATUS_URBS; ++i) {
+		ret = usb_submit_urb(dev->int_urb[i], flags);
+		if (ret < 0) {
+			uvc_status_kill_urbs(dev);
+			return ret;
+		}
+	}
+
+	return 0;
 }
 
 // complete //from uvc_driver suspend
 void uvc_status_stop(struct uvc_device *dev)
 {
-	usb_kill_urb(dev->int_urb);
+	uvc_status_kill_urbs(dev);
+
+	/* Deliver the events received before stopping. */
+	if (dev->status_work.func)
+		flush_work(&dev->status_work);
+	uvc_ctrl_status_invalidate(dev);
 }
@@ -0,0 +1,193 @@
+/*
+ *      uvc_trace.h  --  USB Video Class driver - Tracepoints
+ *
+ *      This program is free software; you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation; either version 2 of the License, or
+ *      (at your option) any later version.
+ *
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM uvcvideo
+
+#if !defined(_UVC_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _UVC_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <linux/usb.h>
+
+#include "uvcvideo.h"
+
+TRACE_DEFINE_ENUM(UVC_FRAME_END_FID);
+TRACE_DEFINE_ENUM(UVC_FRAME_END_EOF);
+TRACE_DEFINE_ENUM(UVC_FRAME_END_OVERFLOW);
+TRACE_DEFINE_ENUM(UVC_FRAME_END_SIZE);
+
+#define show_frame_end(reason)						\
+	__print_symbolic(reason,					\
+			 { UVC_FRAME_END_FID,		"fid" },	\
+			 { UVC_FRAME_END_EOF,		"eof" },	\
+			 { UVC_FRAME_END_OVERFLOW,	"overflow" },	\
+			 { UVC_FRAME_END_SIZE,		"size" })
+
+TRACE_DEFINE_ENUM(UVC_DROP_SYNC);
+TRACE_DEFINE_ENUM(UVC_DROP_LOST);
+
+#define show_drop_reason(reason)					\
+	__print_symbolic(reason,					\
+			 { UVC_DROP_SYNC,		"sync" },	\
+			 { UVC_DROP_LOST,		"lost" })
+
+TRACE_DEFINE_ENUM(UVC_RESYNC_START);
+TRACE_DEFINE_ENUM(UVC_RESYNC_RECOVERY);
+
+#define show_resync_reason(reason)					\
+	__print_symbolic(reason,					\
+			 { UVC_RESYNC_START,		"start" },	\
+			 { UVC_RESYNC_RECOVERY,		"recovery" })
+
+TRACE_EVENT(uvc_urb_complete,
+	TP_PROTO(struct uvc_streaming *stream, struct urb *urb),
+	TP_ARGS(stream, urb),
+
+	TP_STRUCT__entry(
+		__field(int, intf)
+		__field(int, status)
+		__field(unsigned int, length)
+		__field(int, packets)
+	),
+
+	TP_fast_assign(
+		__entry->intf = stream->intfnum;
+		__entry->status = urb->status;
+		__entry->length = urb->actual_length;
+		__entry->packets = urb->number_of_packets;
+	),
+
+	TP_printk("intf %d status %d length %u packets %d",
+		  __entry->intf, __entry->status, __entry->length,
+		  __entry->packets)
+);
+
+TRACE_EVENT(uvc_packet_header,
+	TP_PROTO(struct uvc_streaming *stream, const __u8 *data, int len),
+	TP_ARGS(stream, data, len),
+
+	TP_STRUCT__entry(
+		__field(int, intf)
+		__field(int, len)
+		__field(__u8, header_len)
+		__field(__u8, info)
+	),
+
+	TP_fast_assign(
+		__entry->intf = stream->intfnum;
+		__entry->len = len;
+		__entry->header_len = data[0];
+		__entry->info = data[1];
+	),
+
+	TP_printk("intf %d len %d header %u info 0x%02x%s%s%s",
+		  __entry->intf, __entry->len, __entry->header_len,
+		  __entry->info,
+		  __entry->info & UVC_STREAM_FID ? " fid" : "",
+		  __entry->info & UVC_STREAM_EOF ? " eof" : "",
+		  __entry->info & UVC_STREAM_ERR ? " err" : "")
+);
+
+TRACE_EVENT(uvc_frame_complete,
+	TP_PROTO(struct uvc_streaming *stream, struct uvc_buffer *buf,
+		 u32 sequence, enum uvc_frame_end reason),
+	TP_ARGS(stream, buf, sequence, reason),
+
+	TP_STRUCT__entry(
+		__field(int, intf)
+		__field(u32, sequence)
+		__field(unsigned int, bytesused)
+		__field(unsigned int, error)
+		__field(enum uvc_frame_end, reason)
+	),
+
+	TP_fast_assign(
+		__entry->intf = stream->intfnum;
+		__entry->sequence = sequence;
+		__entry->bytesused = buf->bytesused;
+		__entry->error = buf->error;
+		__entry->reason = reason;
+	),
+
+	TP_printk("intf %d sequence %u bytes %u error %u (%s)",
+		  __entry->intf, __entry->sequence, __entry->bytesused,
+		  __entry->error, show_frame_end(__entry->reason))
+);
+
+TRACE_EVENT(uvc_buffer_drop,
+	TP_PROTO(struct uvc_streaming *stream, struct uvc_buffer *buf),
+	TP_ARGS(stream, buf),
+
+	TP_STRUCT__entry(
+		__field(int, intf)
+		__field(u32, sequence)
+		__field(unsigned int, bytesused)
+	),
+
+	TP_fast_assign(
+		__entry->intf = stream->intfnum;
+		__entry->sequence = stream->sequence;
+		__entry->bytesused = buf->bytesused;
+	),
+
+	TP_printk("intf %d sequence %u bytes %u",
+		  __entry->intf, __entry->sequence, __entry->bytesused)
+);
+
+TRACE_EVENT(uvc_payload_drop,
+	TP_PROTO(struct uvc_streaming *stream, enum uvc_drop_reason reason,
+		 int status),
+	TP_ARGS(stream, reason, status),
+
+	TP_STRUCT__entry(
+		__field(int, intf)
+		__field(enum uvc_drop_reason, reason)
+		__field(int, status)
+	),
+
+	TP_fast_assign(
+		__entry->intf = stream->intfnum;
+		__entry->reason = reason;
+		__entry->status = status;
+	),
+
+	TP_printk("intf %d %s status %d", __entry->intf,
+		  show_drop_reason(__entry->reason), __entry->status)
+);
+
+TRACE_EVENT(uvc_resync,
+	TP_PROTO(struct uvc_streaming *stream, enum uvc_resync_reason reason),
+	TP_ARGS(stream, reason),
+
+	TP_STRUCT__entry(
+		__field(int, intf)
+		__field(u32, sequence)
+		__field(enum uvc_resync_reason, reason)
+	),
+
+	TP_fast_assign(
+		__entry->intf = stream->intfnum;
+		__entry->sequence = stream->sequence;
+		__entry->reason = reason;
+	),
+
+	TP_printk("intf %d sequence %u (%s)", __entry->intf,
+		  __entry->sequence, show_resync_reason(__entry->reason))
+);
+
+#endif /* _UVC_TRACE_H */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE uvc_trace
+#include <trace/define_trace.h>
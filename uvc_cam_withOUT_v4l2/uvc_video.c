@@ -13,7 +13,9 @@
 
 #include<linux/kernel.h>
 #include<linux/list.h>
+#include<linux/mm.h>
 #include<linux/module.h>
+#include<linux/scatterlist.h>
 #include<linux/slab.h>
 #include<linux/usb.h>
 #include<linux/videodev2.h>
@@ -24,6 +26,10 @@
 
 
 #include "uvcvideo.h"
+
+#define CREATE_TRACE_POINTS
+#include "uvc_trace.h"
+
 #define USB_ENDPOINT_MAXP_MASK   0x07ff
 #define USB_EP_MAXP_MULT_SHIFT   11
 #define USB_EP_MAXP_MULT_MASK (3 << USB_EP_MAXP_MULT_SHIFT)
@@ -162,31 +168,35 @@ static const char *uvc_query_name(__u8 query)
 	}
 }
 
+int uvc_query_ctrl(struct uvc_device *dev, __u8 query, __u8 unit,
+			__u8 intfnum, __u8 cs, void *data, __u16 size)
+{
+	int ret;
+
+	ret = __uvc_query_ctrl(dev, query, unit, intfnum, cs, data, size,
+				UVC_CTRL_CONTROL_TIMEOUT);
+	if (ret != size) {
+		uvc_printk(KERN_ERR, "Failed to query (%s) UVC control %u on "
+			"unit %u: %d (exp. %u).\n", uvc_query_name(query), cs,
+			unit, ret, size);
+		return -EIO;
+	}
+
+	return 0;
+}
+
 // complete
 static void uvc_fixup_video_ctrl(struct uvc_streaming *stream,
 	struct uvc_streaming_control *ctrl)
 {
-	struct uvc_format *format = NULL;
-	struct uvc_frame *frame = NULL;
-	unsigned int i;
-
-	for (i = 0; i < stream->nformats; ++i) {
-		if (stream->format[i].index == ctrl->bFormatIndex) {
-			format = &stream->format[i];
-			break;
-		}
-	}
+	struct uvc_format *format;
+	struct uvc_frame *frame;
 
+	format = uvc_format_by_index(stream, ctrl->bFormatIndex);
 	if (format == NULL)
 		return;
 
-	for (i = 0; i < format->nframes; ++i) {
-		if (format->frame[i].bFrameIndex == ctrl->bFrameIndex) {
-			frame = &format->frame[i];
-			break;
-		}
-	}
-
+	frame = uvc_frame_by_index(format, ctrl->bFrameIndex);
 	if (frame == NULL)
 		return;
 
@@ -496,6 +506,12 @@ static int uvc_video_clock_init(struct uvc_streaming *stream)
 {
 	struct uvc_clock *clock = &stream->clock;
 
+	/* Samples are kept across warm restarts. */
+	if (clock->samples != NULL) {
+		uvc_video_clock_reset(stream);
+		return 0;
+	}
+
 	spin_lock_init(&clock->lock);
 	clock->size = 32;
 
@@ -726,9 +742,390 @@ static void uvc_video_stats_stop(struct uvc_streaming *stream)
 	ktime_get_ts(&stream->stats.stream.stop_ts);
 }
 
+/* --------------------------------------------------------------------------
+ * Start timing
+ *
+ * Every stream start is timed from the start request to the first complete
+ * frame, with a timestamp for each phase in between. The last
+ * UVC_START_HISTORY reports are kept and exposed in debugfs.
+ */
+
+static const char *uvc_start_phase_names[UVC_START_NR_PHASES] = {
+	"clock",
+	"commit",
+	"altsetting",
+	"urbs",
+	"submit",
+	"payload",
+	"sync",
+	"frame",
+};
+
+static void uvc_video_start_begin(struct uvc_streaming *stream)
+{
+	memset(&stream->start.cur, 0, sizeof(stream->start.cur));
+	stream->start.t0 = ktime_get_ns() ? : 1;
+}
+
+static void uvc_video_start_mark(struct uvc_streaming *stream,
+		enum uvc_start_phase phase)
+{
+	u64 delta;
+
+	if (stream->start.t0 == 0 || stream->start.cur.us[phase])
+		return;
+
+	delta = ktime_get_ns() - stream->start.t0;
+	stream->start.cur.us[phase] = (u32)div_u64(delta, NSEC_PER_USEC) ? : 1;
+}
+
+/* Called from the completion handler when the first frame is complete. */
+static void uvc_video_start_done(struct uvc_streaming *stream)
+{
+	unsigned int index = stream->start.count % UVC_START_HISTORY;
+	struct uvc_start_report *cur = &stream->start.cur;
+	struct uvc_ttff_stats *stats = &stream->start.ttff[cur->warm];
+	u32 ttff;
+
+	uvc_video_start_mark(stream, UVC_START_FRAME);
+	stream->start.history[index] = *cur;
+	stream->start.count++;
+	stream->start.t0 = 0;
+
+	ttff = cur->us[UVC_START_FRAME];
+	stats->last_us = ttff;
+	if (stats->count == 0 || ttff < stats->min_us)
+		stats->min_us = ttff;
+	if (ttff > stats->max_us)
+		stats->max_us = ttff;
+	stats->count++;
+}
+
+/*
+ * Check whether a payload carries the beginning of a frame. Only compressed
+ * formats have a recognizable start, uncompressed frames are assumed to
+ * start with any payload and are caught by the frame size check otherwise.
+ */
+static bool uvc_video_payload_starts_frame(struct uvc_streaming *stream,
+		const __u8 *data, int len)
+{
+	struct uvc_format *format = stream->cur_format;
+
+	switch (format->fcc) {
+	case VIDEO_PIX_FMT_MJPEG:
+		/* JPEG Start Of Image marker. */
+		return len >= 2 && data[0] == 0xff && data[1] == 0xd8;
+
+	case VIDEO_PIX_FMT_H264:
+	case VIDEO_PIX_FMT_HEVC:
+		/* Annex B start code. */
+		return len >= 3 && data[0] == 0 && data[1] == 0 &&
+		       (data[2] == 1 ||
+			(len >= 4 && data[2] == 0 && data[3] == 1));
+
+	default:
+		return !(format->flags & UVC_FMT_FLAG_COMPRESSED);
+	}
+}
+
+/*
+ * Handle the first non-empty payload of a stream. stream->last_fid is
+ * initialized to -1 so that the payload is accepted right away, which saves
+ * a whole frame interval when it starts a frame. Otherwise, or when fast
+ * synchronization is disabled, pretend that the FID has already been seen
+ * to wait for the next toggle instead of delivering a truncated frame.
+ *
+ * Return -ENODATA for empty payloads, which don't tell anything.
+ */
+static noinline int uvc_video_first_payload(struct uvc_streaming *stream,
+		const __u8 *data, int len)
+{
+	if (len <= data[0])
+		return -ENODATA;
+
+	stream->start.pending = 0;
+	uvc_video_start_mark(stream, UVC_START_PAYLOAD);
+
+	if (!uvc_fast_sync_param ||
+	    !uvc_video_payload_starts_frame(stream, data + data[0],
+					    len - data[0])) {
+		trace_uvc_resync(stream, UVC_RESYNC_START);
+		stream->last_fid = data[1] & UVC_STREAM_FID;
+	}
+
+	return 0;
+}
+
+/*
+ * Select an alternate setting, skipping the request when the interface is
+ * already set to it.
+ */
+static int uvc_video_set_altsetting(struct uvc_streaming *stream,
+		unsigned int altsetting)
+{
+	if (stream->intf->cur_altsetting->desc.bAlternateSetting ==
+	    altsetting) {
+		stream->start.alt_skipped++;
+		return 0;
+	}
+
+	return usb_set_interface(stream->dev->udev, stream->intfnum,
+				 altsetting);
+}
+
+size_t uvc_video_start_dump(struct uvc_streaming *stream, char *buf,
+			    size_t size)
+{
+	struct uvc_start_report *report;
+	unsigned int first;
+	unsigned int i, j;
+	size_t count;
+
+	count = scnprintf(buf, size, "starts %u fast_sync %u "
+			  "altsetting skipped %u\n", stream->start.count,
+			  uvc_fast_sync_param, stream->start.alt_skipped);
+
+	for (i = 0; i < ARRAY_SIZE(stream->start.ttff); ++i) {
+		struct uvc_ttff_stats *stats = &stream->start.ttff[i];
+
+		count += scnprintf(buf + count, size - count,
+				   "%s starts %u ttff last %u min %u max %u us\n",
+				   i ? "warm" : "cold", stats->count,
+				   stats->last_us, stats->min_us,
+				   stats->max_us);
+	}
+
+	first = stream->start.count > UVC_START_HISTORY
+	      ? stream->start.count - UVC_START_HISTORY : 0;
+
+	for (i = first; i < stream->start.count; ++i) {
+		report = &stream->start.history[i % UVC_START_HISTORY];
+		count += scnprintf(buf + count, size - count, "#%u %s", i,
+				   report->warm ? "warm" : "cold");
+
+		for (j = 0; j < UVC_START_NR_PHASES; ++j) {
+			if (report->us[j])
+				count += scnprintf(buf + count, size - count,
+						   " %s %u",
+						   uvc_start_phase_names[j],
+						   report->us[j]);
+			else
+				count += scnprintf(buf + count, size - count,
+						   " %s -",
+						   uvc_start_phase_names[j]);
+		}
+
+		count += scnprintf(buf + count, size - count, " us\n");
+	}
+
+	return count;
+}
+
+/* --------------------------------------------------------------------------
+ * URB errors
+ *
+ * URB completion and resubmission errors are counted per stream instead of
+ * being logged one by one, which would flood the kernel log when a flaky
+ * cable or a bus brownout fails thousands of URBs per second. The first
+ * error is reported right away, the following ones are summarized in a
+ * single line at most every UVC_URB_ERRORS_INTERVAL_MS.
+ */
+
+static const char *uvc_urb_error_names[UVC_URB_NR_ERRORS] = {
+	"proto",
+	"ilseq",
+	"time",
+	"overflow",
+	"pipe",
+	"other",
+	"resubmit",
+};
+
+static enum uvc_urb_error uvc_urb_error_index(int status)
+{
+	switch (status) {
+	case -EPROTO:
+		return UVC_URB_ERROR_PROTO;
+	case -EILSEQ:
+		return UVC_URB_ERROR_ILSEQ;
+	case -ETIME:
+		return UVC_URB_ERROR_TIME;
+	case -EOVERFLOW:
+		return UVC_URB_ERROR_OVERFLOW;
+	case -EPIPE:
+		return UVC_URB_ERROR_PIPE;
+	default:
+		return UVC_URB_ERROR_OTHER;
+	}
+}
+
+/*
+ * Account for a URB error. Can be called from interrupt context.
+ */
+static void uvc_video_urb_error(struct uvc_streaming *stream,
+		enum uvc_urb_error error, int status)
+{
+	unsigned long delay = 0;
+	unsigned long flags;
+
+	spin_lock_irqsave(&stream->urb_errors.lock, flags);
+	stream->urb_errors.total[error]++;
+	stream->urb_errors.window[error]++;
+	stream->urb_errors.last_status = status;
+
+	if (!stream->urb_errors.pending) {
+		unsigned long next = stream->urb_errors.last_report +
+			msecs_to_jiffies(UVC_URB_ERRORS_INTERVAL_MS);
+
+		if (stream->urb_errors.last_report &&
+		    time_before(jiffies, next))
+			delay = next - jiffies;
+
+		stream->urb_errors.pending = 1;
+		schedule_delayed_work(&stream->urb_errors.work, delay);
+	}
+	spin_unlock_irqrestore(&stream->urb_errors.lock, flags);
+}
+
+static void uvc_video_urb_errors_work(struct work_struct *work)
+{
+	struct uvc_streaming *stream = container_of(to_delayed_work(work),
+					struct uvc_streaming, urb_errors.work);
+	unsigned int window[UVC_URB_NR_ERRORS];
+	unsigned int count = 0;
+	unsigned long flags;
+	char msg[128] = "";
+	size_t len = 0;
+	int status;
+	unsigned int i;
+
+	spin_lock_irqsave(&stream->urb_errors.lock, flags);
+	memcpy(window, stream->urb_errors.window, sizeof(window));
+	memset(stream->urb_errors.window, 0, sizeof(window));
+	status = stream->urb_errors.last_status;
+	stream->urb_errors.pending = 0;
+	stream->urb_errors.last_report = jiffies;
+	spin_unlock_irqrestore(&stream->urb_errors.lock, flags);
+
+	for (i = 0; i < UVC_URB_NR_ERRORS; ++i) {
+		if (window[i] == 0)
+			continue;
+
+		count += window[i];
+		len += scnprintf(msg + len, sizeof(msg) - len, " %s %u",
+				 uvc_urb_error_names[i], window[i]);
+	}
+
+	uvc_printk(KERN_WARNING, "Stream %u: %u URB error%s (last %d):%s.\n",
+		   stream->intfnum, count, count == 1 ? "" : "s", status, msg);
+}
+
+size_t uvc_video_urb_errors_dump(struct uvc_streaming *stream, char *buf,
+				 size_t size)
+{
+	unsigned int total[UVC_URB_NR_ERRORS];
+	unsigned long flags;
+	size_t count = 0;
+	int status;
+	unsigned int i;
+
+	spin_lock_irqsave(&stream->urb_errors.lock, flags);
+	memcpy(total, stream->urb_errors.total, sizeof(total));
+	status = stream->urb_errors.last_status;
+	spin_unlock_irqrestore(&stream->urb_errors.lock, flags);
+
+	for (i = 0; i < UVC_URB_NR_ERRORS; ++i)
+		count += scnprintf(buf + count, size - count, "%-10s %u\n",
+				   uvc_urb_error_names[i], total[i]);
+
+	count += scnprintf(buf + count, size - count, "last status %d\n",
+			   status);
+
+	return count;
+}
+
+/* Decode features, see uvc_video_decode_features(). The decode functions
+ * below are specialized at compile time for every combination of features,
+ * the variant matching the stream is selected when streaming starts.
+ */
+#define UVC_DECODE_STATS	(1 << 0)	/* Collect stream statistics */
+#define UVC_DECODE_CLOCK	(1 << 1)	/* Sample the device clock */
+#define UVC_DECODE_NO_FID	(1 << 2)	/* UVC_QUIRK_STREAM_NO_FID */
+#define UVC_DECODE_VARIANTS	(1 << 3)
+
+/*
+ * Record frame corruption in the buffer loss record. All causes but
+ * UVC_LOSS_OVERFLOW mark the buffer as erroneous, overflowing frames are
+ * truncated but delivered as valid, as they always have been.
+ */
+static inline void uvc_video_buffer_loss(struct uvc_buffer *buf,
+		unsigned int cause)
+{
+	buf->loss.causes |= cause;
+	if (cause != UVC_LOSS_OVERFLOW)
+		buf->error = 1;
+}
+
+/*
+ * Record a lost isochronous packet at the current fill level of the buffer.
+ * 'length' is the size of the packet slot, an upper bound of the number of
+ * bytes lost.
+ */
+static void uvc_video_buffer_lost_packet(struct uvc_buffer *buf, int status,
+		unsigned int length)
+{
+	struct uvc_buffer_loss *loss = &buf->loss;
+	unsigned int n = loss->nranges;
+
+	uvc_video_buffer_loss(buf, UVC_LOSS_USB_STATUS);
+	loss->usb_status = status;
+	if (loss->lost_packets < U16_MAX)
+		loss->lost_packets++;
+
+	if (n && n <= UVC_LOSS_RANGES &&
+	    loss->ranges[n - 1].offset == buf->bytesused) {
+		loss->ranges[n - 1].length += length;
+		return;
+	}
+
+	if (n < UVC_LOSS_RANGES) {
+		loss->ranges[n].offset = buf->bytesused;
+		loss->ranges[n].length = length;
+	}
+	if (n < U16_MAX)
+		loss->nranges++;
+}
+
+/*
+ * Resynchronize after a recovery request. Like uvc_video_first_payload(),
+ * pretend that the FID of the current payload has already been seen, so that
+ * data is dropped until the FID toggles. The frame in progress is cut short,
+ * return -EAGAIN to complete it.
+ */
+static noinline int uvc_video_resync(struct uvc_streaming *stream,
+		struct uvc_buffer *buf, const __u8 *data)
+{
+	trace_uvc_resync(stream, UVC_RESYNC_RECOVERY);
+	stream->recovery.resync_fid = false;
+	stream->last_fid = data[1] & UVC_STREAM_FID;
+
+	if (buf == NULL || buf->state != UVC_BUF_STATE_ACTIVE)
+		return 0;
+
+	if (buf->bytesused == 0) {
+		buf->state = UVC_BUF_STATE_QUEUED;
+		return 0;
+	}
+
+	uvc_video_buffer_loss(buf, UVC_LOSS_RESYNC);
+	buf->state = UVC_BUF_STATE_READY;
+	return -EAGAIN;
+}
+
 //complete
-static int uvc_video_decode_start(struct uvc_streaming *stream,
-		struct uvc_buffer *buf, const __u8 *data, int len)
+static __always_inline int uvc_video_decode_start(struct uvc_streaming *stream,
+		struct uvc_buffer *buf, const __u8 *data, int len,
+		const unsigned int features)
 {
 	__u8 fid;
 
@@ -742,6 +1139,22 @@ static int uvc_video_decode_start(struct uvc_streaming *stream,
 		return -EINVAL;
 	}
 
+	trace_uvc_packet_header(stream, data, len);
+
+	if (unlikely(stream->start.pending)) {
+		int ret = uvc_video_first_payload(stream, data, len);
+
+		if (ret < 0)
+			return ret;
+	}
+
+	if (unlikely(stream->recovery.resync_fid)) {
+		int ret = uvc_video_resync(stream, buf, data);
+
+		if (ret < 0)
+			return ret;
+	}
+
 	fid = data[1] & UVC_STREAM_FID;
 
 	/* Increase the sequence number regardless of any buffer states, so
@@ -749,12 +1162,14 @@ static int uvc_video_decode_start(struct uvc_streaming *stream,
 	 */
 	if (stream->last_fid != fid) {
 		stream->sequence++;
-		if (stream->sequence)
+		if ((features & UVC_DECODE_STATS) && stream->sequence)
 			uvc_video_stats_update(stream);
 	}
 
-	uvc_video_clock_decode(stream, buf, data, len);
-	uvc_video_stats_decode(stream, data, len);
+	if (features & UVC_DECODE_CLOCK)
+		uvc_video_clock_decode(stream, buf, data, len);
+	if (features & UVC_DECODE_STATS)
+		uvc_video_stats_decode(stream, data, len);
 
 	/* Store the payload FID bit and return immediately when the buffer is
 	 * NULL.
@@ -765,11 +1180,8 @@ static int uvc_video_decode_start(struct uvc_streaming *stream,
 	}
 
 	/* Mark the buffer as bad if the error bit is set. */
-	if (data[1] & UVC_STREAM_ERR) {
-		uvc_trace(UVC_TRACE_FRAME, "Marking buffer as bad (error bit "
-			  "set).\n");
-		buf->error = 1;
-	}
+	if (data[1] & UVC_STREAM_ERR)
+		uvc_video_buffer_loss(buf, UVC_LOSS_ERR_BIT);
 
 	/* Synchronize to the input stream by waiting for the FID bit to be
 	 * toggled when the the buffer state is not UVC_BUF_STATE_ACTIVE.
@@ -783,9 +1195,8 @@ static int uvc_video_decode_start(struct uvc_streaming *stream,
 		struct timespec ts;
 
 		if (fid == stream->last_fid) {
-			uvc_trace(UVC_TRACE_FRAME, "Dropping payload (out of "
-				"sync).\n");
-			if ((stream->dev->quirks & UVC_QUIRK_STREAM_NO_FID) &&
+			trace_uvc_payload_drop(stream, UVC_DROP_SYNC, 0);
+			if ((features & UVC_DECODE_NO_FID) &&
 			    (data[1] & UVC_STREAM_EOF))
 				stream->last_fid ^= UVC_STREAM_FID;
 			return -ENODATA;
@@ -796,12 +1207,18 @@ static int uvc_video_decode_start(struct uvc_streaming *stream,
 
 		/* TODO: Handle PTS and SCR. */
 		buf->state = UVC_BUF_STATE_ACTIVE;
+		buf->progress = 0;
+		buf->next_watermark = stream->watermark.step;
+
+		if (unlikely(stream->start.t0))
+			uvc_video_start_mark(stream, UVC_START_SYNC);
 	}
 
 	if (fid != stream->last_fid && buf->bytesused != 0) {
-		uvc_trace(UVC_TRACE_FRAME, "Frame complete (FID bit "
-				"toggled).\n");
 		buf->state = UVC_BUF_STATE_READY;
+		/* The FID toggle already accounted for the next frame. */
+		trace_uvc_frame_complete(stream, buf, stream->sequence - 1,
+					 UVC_FRAME_END_FID);
 		return -EAGAIN;
 	}
 
@@ -828,23 +1245,78 @@ static void uvc_video_decode_data(struct uvc_streaming *stream,
 
 	/* Complete the current frame if the buffer size was exceeded. */
 	if (len > maxlen) {
-		uvc_trace(UVC_TRACE_FRAME, "Frame complete (overflow).\n");
+		uvc_video_buffer_loss(buf, UVC_LOSS_OVERFLOW);
+		buf->state = UVC_BUF_STATE_READY;
+		trace_uvc_frame_complete(stream, buf, stream->sequence,
+					 UVC_FRAME_END_OVERFLOW);
+	}
+}
+
+/*
+ * Decode data for fixed-size formats. The frame size is known from the
+ * negotiated probe control, so the frame is complete as soon as it has been
+ * filled, without waiting for the next payload header. Data beyond the frame
+ * size means the frame is corrupted.
+ */
+static void uvc_video_decode_data_fixed(struct uvc_streaming *stream,
+		struct uvc_buffer *buf, const __u8 *data, int len)
+{
+	unsigned int size, maxlen, nbytes;
+
+	if (len <= 0)
+		return;
+
+	size = min(buf->length, stream->ctrl.dwMaxVideoFrameSize);
+	maxlen = size - min(size, buf->bytesused);
+	nbytes = min((unsigned int)len, maxlen);
+	memcpy(buf->mem + buf->bytesused, data, nbytes);
+	buf->bytesused += nbytes;
+
+	if (len > maxlen) {
+		/* Data beyond the negotiated size is corruption, not just a
+		 * too small buffer.
+		 */
+		uvc_video_buffer_loss(buf, UVC_LOSS_OVERFLOW | UVC_LOSS_SIZE);
 		buf->state = UVC_BUF_STATE_READY;
+		trace_uvc_frame_complete(stream, buf, stream->sequence,
+					 UVC_FRAME_END_OVERFLOW);
+	} else if (buf->bytesused == size) {
+		buf->state = UVC_BUF_STATE_READY;
+		trace_uvc_frame_complete(stream, buf, stream->sequence,
+					 UVC_FRAME_END_SIZE);
 	}
 }
 
+/*
+ * Publish the buffer fill level to sub-frame consumers when it crosses the
+ * next watermark. The payload data must be visible before the progress
+ * counter, hence the release store.
+ */
+static void uvc_video_decode_progress(struct uvc_streaming *stream,
+		struct uvc_buffer *buf)
+{
+	unsigned int step = stream->watermark.step;
+
+	if (step == 0 || buf->bytesused < buf->next_watermark)
+		return;
+
+	smp_store_release(&buf->progress, buf->bytesused);
+	buf->next_watermark = rounddown(buf->bytesused, step) + step;
+	wake_up_all(&stream->queue.progress_wait);
+}
+
 
 //complete
-static void uvc_video_decode_end(struct uvc_streaming *stream,
-		struct uvc_buffer *buf, const __u8 *data, int len)
+static __always_inline void uvc_video_decode_end(struct uvc_streaming *stream,
+		struct uvc_buffer *buf, const __u8 *data, int len,
+		const unsigned int features)
 {
 	/* Mark the buffer as done if the EOF marker is set. */
 	if (data[1] & UVC_STREAM_EOF && buf->bytesused != 0) {
-		uvc_trace(UVC_TRACE_FRAME, "Frame complete (EOF found).\n");
-		if (data[0] == len)
-			uvc_trace(UVC_TRACE_FRAME, "EOF in empty payload.\n");
 		buf->state = UVC_BUF_STATE_READY;
-		if (stream->dev->quirks & UVC_QUIRK_STREAM_NO_FID)
+		trace_uvc_frame_complete(stream, buf, stream->sequence,
+					 UVC_FRAME_END_EOF);
+		if (features & UVC_DECODE_NO_FID)
 			stream->last_fid ^= UVC_STREAM_FID;
 	}
 }
@@ -866,8 +1338,13 @@ static int uvc_video_encode_header(struct uvc_streaming *stream,
 		struct uvc_buffer *buf, __u8 *data, int len)
 {
 	data[0] = 2;	/* Header length */
-	data[1] = UVC_STREAM_EOH | UVC_STREAM_EOF
-		| (stream->last_fid & UVC_STREAM_FID);
+	data[1] = UVC_STREAM_EOH | (stream->last_fid & UVC_STREAM_FID);
+
+	/* Only the payload that finishes the buffer carries EOF. */
+	if (buf->bytesused - stream->queue.buf_used <=
+	    stream->bulk.max_payload_size - 2)
+		data[1] |= UVC_STREAM_EOF;
+
 	return 2;
 }
 // complete 
@@ -895,76 +1372,300 @@ static int uvc_video_encode_data(struct uvc_streaming *stream,
  */
 
 
-// complete // decode -isoc
-static void uvc_video_validate_buffer(const struct uvc_streaming *stream,
-				      struct uvc_buffer *buf)
+/*
+ * Find the first 0xff byte in data[pos, len), return len if there's none.
+ * Entropy-coded data is searched a word at a time, a 0xff byte being a zero
+ * byte in the inverted word. The scan is bound by memory bandwidth.
+ */
+static size_t uvc_video_jpeg_find_ff(const __u8 *data, size_t pos,
+		size_t len)
 {
-	if (stream->ctrl.dwMaxVideoFrameSize != buf->bytesused &&
-	    !(stream->cur_format->flags & UVC_FMT_FLAG_COMPRESSED))
-		buf->error = 1;
+	const unsigned long ones = REPEAT_BYTE(0x01);
+	const unsigned long highs = REPEAT_BYTE(0x80);
+	unsigned long v;
+
+	while (pos < len &&
+	       !IS_ALIGNED((unsigned long)(data + pos), sizeof(v))) {
+		if (data[pos] == 0xff)
+			return pos;
+		pos++;
+	}
+
+	while (pos + sizeof(v) <= len) {
+		v = ~*(const unsigned long *)(data + pos);
+		if ((v - ones) & ~v & highs)
+			break;
+		pos += sizeof(v);
+	}
+
+	while (pos < len && data[pos] != 0xff)
+		pos++;
+
+	return pos;
 }
 
 /*
- * Completion handler for video URBs.
+ * Check that an MJPEG frame starts with SOI and ends with EOI, ignoring zero
+ * padding some devices add after EOI. With 'scan' set, also walk the header
+ * segments and check that every 0xff byte in the entropy-coded data is
+ * either stuffed, a fill byte or a restart marker.
  */
-
-//complete --d
-static void uvc_video_decode_isoc(struct urb *urb, struct uvc_streaming *stream,
-	struct uvc_buffer *buf)
+static bool uvc_video_jpeg_valid(const __u8 *data, size_t len, bool scan)
 {
-	u8 *mem;
-	int ret, i;
+	size_t end = len;
+	size_t pos;
+	__u8 marker;
 
-	for (i = 0; i < urb->number_of_packets; ++i) {
-		if (urb->iso_frame_desc[i].status < 0) {
-			uvc_trace(UVC_TRACE_FRAME, "USB isochronous frame "
-				"lost (%d).\n", urb->iso_frame_desc[i].status);
-			/* Mark the buffer as faulty. */
-			if (buf != NULL)
-				buf->error = 1;
+	while (end > 2 && data[end - 1] == 0)
+		end--;
+
+	if (end < 4 || data[0] != 0xff || data[1] != 0xd8 ||
+	    data[end - 2] != 0xff || data[end - 1] != 0xd9)
+		return false;
+
+	if (!scan)
+		return true;
+
+	/* Skip the header segments up to and including the start of scan. */
+	pos = 2;
+	do {
+		if (pos + 4 > end || data[pos] != 0xff)
+			return false;
+
+		marker = data[pos + 1];
+		if (marker == 0xff) {
+			pos++;
 			continue;
 		}
 
-		/* Decode the payload header. */
-		mem = urb->transfer_buffer + urb->iso_frame_desc[i].offset;
-		do {
-			ret = uvc_video_decode_start(stream, buf, mem,
-				urb->iso_frame_desc[i].actual_length);
-			if (ret == -EAGAIN) {
-				uvc_video_validate_buffer(stream, buf);
-				buf = uvc_queue_next_buffer(&stream->queue,
-							    buf);
-			}
-		} while (ret == -EAGAIN);
+		if (get_unaligned_be16(&data[pos + 2]) < 2)
+			return false;
 
-		if (ret < 0)
-			continue;
+		pos += 2 + get_unaligned_be16(&data[pos + 2]);
+	} while (marker != 0xda);
 
-		/* Decode the payload data. */
-		uvc_video_decode_data(stream, buf, mem + ret,
-			urb->iso_frame_desc[i].actual_length - ret);
+	/* Scan the entropy-coded data, the 0xff byte of EOI excluded. */
+	end -= 2;
+	if (pos > end)
+		return false;
 
-		/* Process the header again. */
-		uvc_video_decode_end(stream, buf, mem,
-			urb->iso_frame_desc[i].actual_length);
+	while (pos < end) {
+		pos = uvc_video_jpeg_find_ff(data, pos, end);
+		if (pos >= end)
+			break;
 
-		if (buf->state == UVC_BUF_STATE_READY) {
-			uvc_video_validate_buffer(stream, buf);
-			buf = uvc_queue_next_buffer(&stream->queue, buf);
+		/* data[end] is the EOI 0xff, valid as a fill byte. */
+		marker = data[pos + 1];
+		if (marker == 0xff) {
+			pos++;
+			continue;
 		}
+
+		if (marker != 0x00 && (marker < 0xd0 || marker > 0xd7))
+			return false;
+
+		pos += 2;
 	}
+
+	return true;
 }
-//complete --d
-static void uvc_video_decode_bulk(struct urb *urb, struct uvc_streaming *stream,
-	struct uvc_buffer *buf)
+
+// complete // decode -isoc
+static void uvc_video_validate_buffer(const struct uvc_streaming *stream,
+				      struct uvc_buffer *buf)
 {
-	u8 *mem;
-	int len, ret;
+	if (stream->cur_format->flags & UVC_FMT_FLAG_COMPRESSED) {
+		unsigned int check = READ_ONCE(uvc_mjpeg_check_param);
 
-	/*
-	 * Ignore ZLPs if they're not part of a frame, otherwise process them
-	 * to trigger the end of payload detection.
-	 */
+		if (check && !buf->error &&
+		    stream->cur_format->fcc == VIDEO_PIX_FMT_MJPEG &&
+		    !uvc_video_jpeg_valid(buf->mem, buf->bytesused, check > 1))
+			uvc_video_buffer_loss(buf, UVC_LOSS_FORMAT);
+		return;
+	}
+
+	if (stream->ctrl.dwMaxVideoFrameSize != buf->bytesused)
+		uvc_video_buffer_loss(buf, UVC_LOSS_SIZE);
+}
+
+/*
+ * Static scene detection
+ *
+ * With a dedup threshold set, the signature of every good uncompressed frame
+ * is compared with the one of the last delivered frame. Frames that didn't
+ * change enough are marked as duplicate and delivered without data. The
+ * signature samples one 64-bit word every UVC_DEDUP_STRIDE bytes and sums
+ * its bytes in general purpose registers, which keeps the cost to a
+ * fraction of the frame's cache lines.
+ */
+static unsigned int uvc_video_dedup_signature(const __u8 *mem, size_t size,
+		u32 *sig)
+{
+	const u64 mask = 0x00ff00ff00ff00ffULL;
+	size_t block = size / UVC_DEDUP_BLOCKS;
+	unsigned int samples = 0;
+	unsigned int i;
+	size_t off;
+
+	for (i = 0; i < UVC_DEDUP_BLOCKS; ++i) {
+		const __u8 *p = mem + i * block;
+		u32 sum = 0;
+
+		for (off = 0; off + 8 <= block; off += UVC_DEDUP_STRIDE) {
+			u64 w = get_unaligned((const u64 *)(p + off));
+
+			/* Add the bytes pairwise in 16-bit lanes, then add
+			 * the lanes in the top 16 bits.
+			 */
+			w = (w & mask) + ((w >> 8) & mask);
+			sum += (w * 0x0001000100010001ULL) >> 48;
+			if (i == 0)
+				samples++;
+		}
+
+		sig[i] = sum;
+	}
+
+	return samples;
+}
+
+static void uvc_video_dedup(struct uvc_streaming *stream,
+		struct uvc_buffer *buf)
+{
+	u32 threshold = READ_ONCE(stream->dedup.threshold);
+	u32 sig[UVC_DEDUP_BLOCKS];
+	unsigned int samples;
+	unsigned int i;
+
+	if (threshold == 0) {
+		stream->dedup.valid = 0;
+		return;
+	}
+
+	/* Corrupted frames neither get deduplicated nor become the
+	 * reference.
+	 */
+	if (buf->error || buf->bytesused < UVC_DEDUP_BLOCKS * UVC_DEDUP_STRIDE)
+		return;
+
+	samples = uvc_video_dedup_signature(buf->mem, buf->bytesused, sig);
+
+	if (stream->dedup.valid) {
+		/* Changes are measured in 1/16th of the average byte value
+		 * of a block.
+		 */
+		for (i = 0; i < UVC_DEDUP_BLOCKS; ++i) {
+			u32 diff = abs((s32)(sig[i] - stream->dedup.sig[i]));
+
+			if (diff * 16 / (samples * 8) > threshold)
+				break;
+		}
+
+		if (i == UVC_DEDUP_BLOCKS) {
+			buf->duplicate = 1;
+			buf->bytesused = 0;
+			stream->dedup.skipped++;
+			return;
+		}
+	}
+
+	memcpy(stream->dedup.sig, sig, sizeof(sig));
+	stream->dedup.valid = 1;
+}
+
+/*
+ * Finalize a completed frame before handing it to the queue.
+ */
+static void uvc_video_complete_buffer(struct uvc_streaming *stream,
+		struct uvc_buffer *buf)
+{
+	uvc_video_validate_buffer(stream, buf);
+
+	if (!(stream->cur_format->flags & UVC_FMT_FLAG_COMPRESSED))
+		uvc_video_dedup(stream, buf);
+}
+
+/*
+ * Completion handler for video URBs.
+ */
+
+//complete --d
+static __always_inline void __uvc_video_decode_isoc(struct urb *urb,
+	struct uvc_streaming *stream, struct uvc_buffer *buf,
+	const unsigned int features)
+{
+	unsigned int nerrors = 0;
+	u8 *mem;
+	int ret, i;
+
+	for (i = 0; i < urb->number_of_packets; ++i) {
+		if (urb->iso_frame_desc[i].status < 0) {
+			trace_uvc_payload_drop(stream, UVC_DROP_LOST,
+					       urb->iso_frame_desc[i].status);
+			/* Mark the buffer as faulty. */
+			if (buf != NULL)
+				uvc_video_buffer_lost_packet(buf,
+					urb->iso_frame_desc[i].status,
+					urb->iso_frame_desc[i].length);
+			nerrors++;
+			continue;
+		}
+
+		/* Decode the payload header. */
+		mem = urb->transfer_buffer + urb->iso_frame_desc[i].offset;
+		do {
+			ret = uvc_video_decode_start(stream, buf, mem,
+				urb->iso_frame_desc[i].actual_length, features);
+			if (ret == -EAGAIN) {
+				uvc_video_complete_buffer(stream, buf);
+				buf = uvc_queue_next_buffer(&stream->queue,
+							    buf);
+			}
+		} while (ret == -EAGAIN);
+
+		if (ret < 0)
+			continue;
+
+		/* Decode the payload data. */
+		stream->decode_data(stream, buf, mem + ret,
+			urb->iso_frame_desc[i].actual_length - ret);
+		uvc_video_decode_progress(stream, buf);
+
+		/* Process the header again. */
+		uvc_video_decode_end(stream, buf, mem,
+			urb->iso_frame_desc[i].actual_length, features);
+
+		if (buf->state == UVC_BUF_STATE_READY) {
+			uvc_video_complete_buffer(stream, buf);
+			buf = uvc_queue_next_buffer(&stream->queue, buf);
+		}
+	}
+
+	/* Isolated lost packets are expected, only recover from a sustained
+	 * loss of the majority of packets.
+	 */
+	if (nerrors * 2 > urb->number_of_packets) {
+		if (++stream->recovery.iso_errors >=
+		    UVC_RECOVERY_ISO_THRESHOLD) {
+			stream->recovery.iso_errors = 0;
+			uvc_video_recover(stream, UVC_RECOVERY_REASON_ISO);
+		}
+	} else {
+		stream->recovery.iso_errors = 0;
+	}
+}
+//complete --d
+static __always_inline void __uvc_video_decode_bulk(struct urb *urb,
+	struct uvc_streaming *stream, struct uvc_buffer *buf,
+	const unsigned int features)
+{
+	u8 *mem;
+	int len, ret;
+
+	/*
+	 * Ignore ZLPs if they're not part of a frame, otherwise process them
+	 * to trigger the end of payload detection.
+	 */
 	if (urb->actual_length == 0 && stream->bulk.header_size == 0)
 		return;
 
@@ -977,10 +1678,13 @@ static void uvc_video_decode_bulk(struct urb *urb, struct uvc_streaming *stream,
 	 */
 	if (stream->bulk.header_size == 0 && !stream->bulk.skip_payload) {
 		do {
-			ret = uvc_video_decode_start(stream, buf, mem, len);
-			if (ret == -EAGAIN)
+			ret = uvc_video_decode_start(stream, buf, mem, len,
+						     features);
+			if (ret == -EAGAIN) {
+				uvc_video_complete_buffer(stream, buf);
 				buf = uvc_queue_next_buffer(&stream->queue,
 							    buf);
+			}
 		} while (ret == -EAGAIN);
 
 		/* If an error occurred skip the rest of the payload. */
@@ -1001,8 +1705,10 @@ static void uvc_video_decode_bulk(struct urb *urb, struct uvc_streaming *stream,
 	 */
 
 	/* Process video data. */
-	if (!stream->bulk.skip_payload && buf != NULL)
-		uvc_video_decode_data(stream, buf, mem, len);
+	if (!stream->bulk.skip_payload && buf != NULL) {
+		stream->decode_data(stream, buf, mem, len);
+		uvc_video_decode_progress(stream, buf);
+	}
 
 	/* Detect the payload end by a URB smaller than the maximum size (or
 	 * a payload size equal to the maximum) and process the header again.
@@ -1011,9 +1717,11 @@ static void uvc_video_decode_bulk(struct urb *urb, struct uvc_streaming *stream,
 	    stream->bulk.payload_size >= stream->bulk.max_payload_size) {
 		if (!stream->bulk.skip_payload && buf != NULL) {
 			uvc_video_decode_end(stream, buf, stream->bulk.header,
-				stream->bulk.payload_size);
-			if (buf->state == UVC_BUF_STATE_READY)
+				stream->bulk.payload_size, features);
+			if (buf->state == UVC_BUF_STATE_READY) {
+				uvc_video_complete_buffer(stream, buf);
 				uvc_queue_next_buffer(&stream->queue, buf);
+			}
 		}
 
 		stream->bulk.header_size = 0;
@@ -1021,6 +1729,53 @@ static void uvc_video_decode_bulk(struct urb *urb, struct uvc_streaming *stream,
 		stream->bulk.payload_size = 0;
 	}
 }
+#define UVC_DECODE_VARIANT(type, features)				\
+static void uvc_video_decode_##type##_##features(struct urb *urb,	\
+	struct uvc_streaming *stream, struct uvc_buffer *buf)		\
+{									\
+	__uvc_video_decode_##type(urb, stream, buf, features);		\
+}
+
+#define UVC_DECODE_VARIANT_TABLE(type)					\
+UVC_DECODE_VARIANT(type, 0)						\
+UVC_DECODE_VARIANT(type, 1)						\
+UVC_DECODE_VARIANT(type, 2)						\
+UVC_DECODE_VARIANT(type, 3)						\
+UVC_DECODE_VARIANT(type, 4)						\
+UVC_DECODE_VARIANT(type, 5)						\
+UVC_DECODE_VARIANT(type, 6)						\
+UVC_DECODE_VARIANT(type, 7)						\
+									\
+static const uvc_decode_fn						\
+uvc_video_decode_##type##_variants[UVC_DECODE_VARIANTS] = {		\
+	uvc_video_decode_##type##_0, uvc_video_decode_##type##_1,	\
+	uvc_video_decode_##type##_2, uvc_video_decode_##type##_3,	\
+	uvc_video_decode_##type##_4, uvc_video_decode_##type##_5,	\
+	uvc_video_decode_##type##_6, uvc_video_decode_##type##_7,	\
+};
+
+UVC_DECODE_VARIANT_TABLE(isoc)
+UVC_DECODE_VARIANT_TABLE(bulk)
+
+/*
+ * Compute the decode features for the next stream run. Statistics are only
+ * collected when they can be read through debugfs or traced, and the device
+ * clock only needs to be sampled for hardware timestamps.
+ */
+static unsigned int uvc_video_decode_features(struct uvc_streaming *stream)
+{
+	unsigned int features = 0;
+
+	if (stream->debugfs_dir != NULL || (uvc_trace_param & UVC_TRACE_STATS))
+		features |= UVC_DECODE_STATS;
+	if (uvc_hw_timestamps_param)
+		features |= UVC_DECODE_CLOCK;
+	if (stream->dev->quirks & UVC_QUIRK_STREAM_NO_FID)
+		features |= UVC_DECODE_NO_FID;
+
+	return features;
+}
+
 // complete --d
 static void uvc_video_encode_bulk(struct urb *urb, struct uvc_streaming *stream,
 	struct uvc_buffer *buf)
@@ -1065,6 +1820,189 @@ static void uvc_video_encode_bulk(struct urb *urb, struct uvc_streaming *stream,
 	urb->transfer_buffer_length = stream->urb_size - len;
 }
 
+/*
+ * Scatter-gather output. Every URB carries a whole payload: a small header
+ * segment followed by segments pointing straight at the video buffer, so the
+ * frame data is never copied. Frames larger than a payload are split over
+ * several payloads, with the EOF bit set on the last one only.
+ *
+ * Only host controllers without constraints on the scatter-gather segment
+ * sizes are supported, see uvc_video_find_ops(). Others require all segments
+ * but the last to be a multiple of the endpoint max packet size, which the
+ * header segment never is.
+ *
+ * A buffer stays at the head of the queue until the URB carrying its last
+ * payload completes. Buffers whose last payload has been submitted are marked
+ * READY, the buffer being encoded is the first one that isn't.
+ *
+ * URBs with nothing to send are parked in the idle mask instead of being
+ * resubmitted empty, and are submitted again by uvc_video_kick_sg() when a
+ * buffer is queued. Filling and submission are serialized by sg_out.lock to
+ * keep payloads in order.
+ */
+static unsigned int uvc_video_sg_map(struct scatterlist *sg, void *mem,
+	unsigned int len)
+{
+	unsigned int count = 0;
+	unsigned int nbytes;
+	struct page *page;
+
+	while (len) {
+		page = is_vmalloc_addr(mem) ? vmalloc_to_page(mem)
+		     : virt_to_page(mem);
+		nbytes = min_t(unsigned int, len, PAGE_SIZE - offset_in_page(mem));
+		sg_set_page(&sg[count++], page, nbytes, offset_in_page(mem));
+		mem += nbytes;
+		len -= nbytes;
+	}
+
+	return count;
+}
+
+/*
+ * Fill URB i with the next payload. Return false if there's nothing to send.
+ * Must be called with sg_out.lock held.
+ */
+static bool uvc_video_sg_fill(struct uvc_streaming *stream, unsigned int i)
+{
+	struct uvc_video_queue *queue = &stream->queue;
+	struct urb *urb = stream->urb[i];
+	struct uvc_buffer *cur = NULL;
+	struct uvc_buffer *buf;
+	struct scatterlist *sg;
+	unsigned long flags;
+	unsigned int count;
+	unsigned int nbytes;
+	__u8 *header;
+
+	spin_lock_irqsave(&queue->irqlock, flags);
+	list_for_each_entry(buf, &queue->irqqueue, queue) {
+		if (buf->state != UVC_BUF_STATE_READY) {
+			cur = buf;
+			break;
+		}
+	}
+	spin_unlock_irqrestore(&queue->irqlock, flags);
+
+	if (cur == NULL)
+		return false;
+
+	if (stream->sg_out.offset == 0)
+		cur->state = UVC_BUF_STATE_ACTIVE;
+
+	nbytes = min(cur->bytesused - stream->sg_out.offset,
+		     stream->sg_out.max_data);
+
+	header = stream->sg_out.header[i];
+	header[0] = 2;	/* Header length */
+	header[1] = UVC_STREAM_EOH | (stream->last_fid & UVC_STREAM_FID);
+	if (stream->sg_out.offset + nbytes == cur->bytesused)
+		header[1] |= UVC_STREAM_EOF;
+
+	sg = stream->sg_out.sg[i];
+	sg_init_table(sg, stream->sg_out.nents);
+	sg_set_buf(&sg[0], header, 2);
+	count = 1 + uvc_video_sg_map(&sg[1], cur->mem + stream->sg_out.offset,
+				     nbytes);
+	sg_mark_end(&sg[count - 1]);
+
+	urb->num_sgs = count;
+	urb->transfer_buffer_length = 2 + nbytes;
+	stream->sg_out.offset += nbytes;
+
+	if (header[1] & UVC_STREAM_EOF) {
+		cur->state = UVC_BUF_STATE_READY;
+		stream->sg_out.buf[i] = cur;
+		stream->sg_out.offset = 0;
+		stream->last_fid ^= UVC_STREAM_FID;
+	}
+
+	return true;
+}
+
+/*
+ * Submit URB i. On failure the URB is parked, and the buffer whose last
+ * payload it carried is completed with an error. Must be called with
+ * sg_out.lock held.
+ */
+static void uvc_video_sg_submit(struct uvc_streaming *stream, unsigned int i)
+{
+	struct uvc_buffer *buf = stream->sg_out.buf[i];
+	int ret;
+
+	ret = usb_submit_urb(stream->urb[i], GFP_ATOMIC);
+	if (ret == 0)
+		return;
+
+	uvc_video_urb_error(stream, UVC_URB_ERROR_RESUBMIT, ret);
+	stream->sg_out.idle |= BIT(i);
+
+	if (buf != NULL) {
+		stream->sg_out.buf[i] = NULL;
+		buf->error = 1;
+		uvc_queue_next_buffer(&stream->queue, buf);
+	}
+}
+
+static void uvc_video_encode_bulk_sg(struct urb *urb,
+	struct uvc_streaming *stream, struct uvc_buffer *buf)
+{
+	unsigned long flags;
+	unsigned int i;
+
+	for (i = 0; i < UVC_URBS; ++i) {
+		if (stream->urb[i] == urb)
+			break;
+	}
+
+	spin_lock_irqsave(&stream->sg_out.lock, flags);
+
+	/* The URB carried the last payload of a buffer, complete it. */
+	if (stream->sg_out.buf[i] != NULL) {
+		uvc_queue_next_buffer(&stream->queue, stream->sg_out.buf[i]);
+		stream->sg_out.buf[i] = NULL;
+	}
+
+	if (stream->sg_out.running && uvc_video_sg_fill(stream, i))
+		uvc_video_sg_submit(stream, i);
+	else
+		stream->sg_out.idle |= BIT(i);
+
+	spin_unlock_irqrestore(&stream->sg_out.lock, flags);
+}
+
+/*
+ * Submit parked URBs for newly queued buffers. Can be called from interrupt
+ * context.
+ */
+static void uvc_video_kick_sg(struct uvc_streaming *stream)
+{
+	unsigned long flags;
+	unsigned int i;
+
+	spin_lock_irqsave(&stream->sg_out.lock, flags);
+	while (stream->sg_out.running && stream->sg_out.idle) {
+		i = __ffs(stream->sg_out.idle);
+		if (!uvc_video_sg_fill(stream, i))
+			break;
+
+		stream->sg_out.idle &= ~BIT(i);
+		uvc_video_sg_submit(stream, i);
+	}
+	spin_unlock_irqrestore(&stream->sg_out.lock, flags);
+}
+
+/*
+ * Return true if the device has been unplugged. -EPROTO is also reported by
+ * a flaky cable or a brownout on a device that's still there, leave it to
+ * stream recovery.
+ */
+static bool uvc_video_device_gone(struct uvc_streaming *stream, int status)
+{
+	return status == -ENODEV || status == -ESHUTDOWN ||
+	       stream->dev->udev->state == USB_STATE_NOTATTACHED;
+}
+
 // complete
 static void uvc_video_complete(struct urb *urb)
 {
@@ -1075,14 +2013,42 @@ struct uvc_buffer *buf =NULL;
 unsigned long flags;
 int ret;
 
+    trace_uvc_urb_complete(stream, urb);
+
     switch (urb->status) {
         case 0:
+            stream->recovery.urb_errors = 0;
             break;
 
         default:
-            uvc_printk(KERN_WARNING, "Non-zero status (%d) in video "
-                    "completion handler.\n", urb->status);
-            /* fall through */
+            uvc_video_urb_error(stream, uvc_urb_error_index(urb->status),
+                    urb->status);
+            if (uvc_video_device_gone(stream, urb->status)) {
+                uvc_queue_cancel(queue, 1);
+                return;
+            }
+
+            /* Persistent errors: the URB isn't resubmitted, recovery
+             * reinitializes the stream with the buffers still queued.
+             */
+            if (++stream->recovery.urb_errors >= UVC_RECOVERY_URB_THRESHOLD) {
+                stream->recovery.urb_errors = 0;
+                uvc_video_recover(stream, UVC_RECOVERY_REASON_URB);
+                return;
+            }
+
+            /* Isolated errors only lose the URB payload. Output streams go
+             * on with the next payload, capture streams resubmit the URB
+             * without decoding it and resync on the next frame.
+             */
+            if (stream->type == VIDEO_BUF_TYPE_VIDEO_OUTPUT)
+                break;
+
+            atomic_set(&stream->recovery.resync, 1);
+            if ((ret = usb_submit_urb(urb, GFP_ATOMIC)) < 0)
+                uvc_video_urb_error(stream, UVC_URB_ERROR_RESUBMIT, ret);
+            return;
+
         case -ENOENT:		/* usb_kill_urb() called. */
             if (stream->frozen)
                 return;
@@ -1099,13 +2065,32 @@ int ret;
                 queue);
     spin_unlock_irqrestore(&queue->irqlock, flags);
 
-    stream->decode(urb, stream, buf);
-
-    if ((ret = usb_submit_urb(urb, GFP_ATOMIC)) < 0) {
-        uvc_printk(KERN_ERR, "Failed to resubmit video URB (%d).\n",
-                ret);
+    /* Resynchronize on the next FID toggle when requested by the recovery
+     * handler, see uvc_video_resync().
+     */
+    if (atomic_xchg(&stream->recovery.resync, 0)) {
+        stream->bulk.header_size = 0;
+        stream->bulk.skip_payload = 0;
+        stream->bulk.payload_size = 0;
+        stream->recovery.resync_fid = true;
     }
 
+    if (stream->nal_active)
+        uvc_nal_decode(urb, stream);
+    else
+        stream->decode(urb, stream, buf);
+
+    /* The first frame is complete when the sequence number reaches 1. */
+    if (unlikely(stream->start.t0) && (s32)stream->sequence >= 1)
+        uvc_video_start_done(stream);
+
+    /* Self-submitting transfer operations resubmit from their handler. */
+    if (stream->ops->kick != NULL)
+        return;
+
+    if ((ret = usb_submit_urb(urb, GFP_ATOMIC)) < 0)
+        uvc_video_urb_error(stream, UVC_URB_ERROR_RESUBMIT, ret);
+
 
  /*   spin_lock_irqsave(&my_irqlock, t_flags);
     dp_urb = urb; 
@@ -1214,6 +2199,8 @@ static void uvc_uninit_video(struct uvc_streaming *stream, int free_buffers)
 
 	if (free_buffers)
 		uvc_free_urb_buffers(stream);
+
+	stream->standby.ready = 0;
 }
 
 /*
@@ -1341,7 +2328,7 @@ static int uvc_init_video_bulk(struct uvc_streaming *stream,
 		pipe = usb_sndbulkpipe(stream->dev->udev,
 				       ep->desc.bEndpointAddress);
 
-	if (stream->type == V4L2_BUF_TYPE_VIDEO_OUTPUT)
+	if (stream->type == VIDEO_BUF_TYPE_VIDEO_OUTPUT)
 		size = 0;
 
 	for (i = 0; i < UVC_URBS; ++i) {
@@ -1365,38 +2352,224 @@ static int uvc_init_video_bulk(struct uvc_streaming *stream,
 	return 0;
 }
 
+static void uvc_uninit_video_sg(struct uvc_streaming *stream, int free_buffers)
+{
+	struct uvc_video_queue *queue = &stream->queue;
+	struct uvc_buffer *buf;
+	unsigned long flags;
+	unsigned int i;
+
+	uvc_video_stats_stop(stream);
+
+	/* Stop the handlers from filling and submitting URBs. */
+	spin_lock_irqsave(&stream->sg_out.lock, flags);
+	stream->sg_out.running = 0;
+	stream->sg_out.idle = 0;
+	spin_unlock_irqrestore(&stream->sg_out.lock, flags);
+
+	for (i = 0; i < UVC_URBS; ++i) {
+		if (stream->urb[i] != NULL) {
+			usb_kill_urb(stream->urb[i]);
+			usb_free_urb(stream->urb[i]);
+			stream->urb[i] = NULL;
+		}
+
+		kfree(stream->sg_out.sg[i]);
+		kfree(stream->sg_out.header[i]);
+		stream->sg_out.sg[i] = NULL;
+		stream->sg_out.header[i] = NULL;
+		stream->sg_out.buf[i] = NULL;
+	}
+
+	/* Buffers that were partly or fully submitted will be sent again from
+	 * the start when streaming resumes.
+	 */
+	spin_lock_irqsave(&queue->irqlock, flags);
+	list_for_each_entry(buf, &queue->irqqueue, queue)
+		buf->state = UVC_BUF_STATE_QUEUED;
+	spin_unlock_irqrestore(&queue->irqlock, flags);
+
+	stream->sg_out.offset = 0;
+	stream->standby.ready = 0;
+}
+
+static int uvc_init_video_bulk_sg(struct uvc_streaming *stream,
+	struct usb_host_endpoint *ep, gfp_t gfp_flags)
+{
+	unsigned int sg_tablesize = stream->dev->udev->bus->sg_tablesize;
+	unsigned int max_data;
+	unsigned int pipe;
+	struct urb *urb;
+	unsigned int i;
+
+	stream->bulk.max_payload_size = stream->ctrl.dwMaxPayloadTransferSize;
+	if (stream->bulk.max_payload_size <= 2)
+		return -EINVAL;
+
+	/* Limit the payload data to what the host controller can map in a
+	 * single URB, with one segment for the header and one more for data
+	 * not aligned on a page boundary.
+	 */
+	max_data = stream->bulk.max_payload_size - 2;
+	if (sg_tablesize < 3)
+		return -EINVAL;
+	max_data = min_t(unsigned int, max_data, (sg_tablesize - 2) * PAGE_SIZE);
+
+	stream->sg_out.max_data = max_data;
+	stream->sg_out.nents = 2 + DIV_ROUND_UP(max_data, PAGE_SIZE);
+	stream->sg_out.offset = 0;
+
+	pipe = usb_sndbulkpipe(stream->dev->udev, ep->desc.bEndpointAddress);
+
+	for (i = 0; i < UVC_URBS; ++i) {
+		urb = usb_alloc_urb(0, gfp_flags);
+		stream->sg_out.sg[i] = kmalloc_array(stream->sg_out.nents,
+				sizeof(struct scatterlist), gfp_flags);
+		stream->sg_out.header[i] = kmalloc(2, gfp_flags);
+		stream->urb[i] = urb;
+
+		if (urb == NULL || stream->sg_out.sg[i] == NULL ||
+		    stream->sg_out.header[i] == NULL) {
+			uvc_uninit_video_sg(stream, 1);
+			return -ENOMEM;
+		}
+
+		/* URBs start parked, see uvc_video_submit(). */
+		usb_fill_bulk_urb(urb, stream->dev->udev, pipe, NULL, 0,
+			uvc_video_complete, stream);
+		urb->transfer_flags = URB_ZERO_PACKET;
+	}
+
+	uvc_trace(UVC_TRACE_VIDEO, "Allocated %u scatter-gather URBs of up to "
+		"%u bytes of payload data.\n", UVC_URBS, max_data);
+
+	return 0;
+}
+
 /*
  * Initialize isochronous/bulk URBs and allocate transfer buffers.
  */
 
 //complete
-static int uvc_init_video(struct uvc_streaming *stream, gfp_t gfp_flags)
+/*
+ * Reset the per-run stream state and select the decoding functions. Called
+ * every time streaming starts, including warm restarts.
+ */
+static void uvc_video_start_run(struct uvc_streaming *stream)
 {
-	struct usb_interface *intf = stream->intf;
-	struct usb_host_endpoint *ep;
-	unsigned int i;
-	int ret;
-
 	stream->sequence = -1;
 	stream->last_fid = -1;
+	stream->recovery.iso_errors = 0;
+	stream->recovery.urb_errors = 0;
+	atomic_set(&stream->recovery.resync, 0);
+	stream->recovery.resync_fid = false;
 	stream->bulk.header_size = 0;
 	stream->bulk.skip_payload = 0;
 	stream->bulk.payload_size = 0;
+	stream->start.pending = 1;
+	stream->dedup.valid = 0;
 
 	uvc_video_stats_start(stream);
 
-	if (intf->num_altsetting > 1) {
-		struct usb_host_endpoint *best_ep = NULL;
-		unsigned int best_psize = UINT_MAX;
-		unsigned int bandwidth;
-		unsigned int uninitialized_var(altsetting);
-		int intfnum = stream->intfnum;
+	/* Select the decode variant for the features enabled for this run. */
+	if (stream->ops->variants != NULL)
+		stream->decode = stream->ops->variants[
+			uvc_video_decode_features(stream)];
 
-		/* Isochronous endpoint, select the alternate setting. */
-		bandwidth = stream->ctrl.dwMaxPayloadTransferSize;
+	/* Select the payload data decoding function for the current format.
+	 * Formats with an unknown or variable frame size, or that need
+	 * conversion, go through the generic path.
+	 */
+	if ((stream->cur_format->hints &
+	     (UVC_FMT_HINT_FIXED_SIZE | UVC_FMT_HINT_DIRECT)) ==
+	    (UVC_FMT_HINT_FIXED_SIZE | UVC_FMT_HINT_DIRECT) &&
+	    stream->ctrl.dwMaxVideoFrameSize != 0)
+		stream->decode_data = uvc_video_decode_data_fixed;
+	else
+		stream->decode_data = uvc_video_decode_data;
 
-		if (bandwidth == 0) {
-			uvc_trace(UVC_TRACE_VIDEO, "Device requested null "
+	/* Compute the sub-frame delivery step. Line watermarks need a known
+	 * line length.
+	 */
+	stream->watermark.step = stream->watermark.bytes;
+	if (stream->watermark.step == 0 && stream->watermark.lines &&
+	    stream->cur_frame != NULL)
+		stream->watermark.step = stream->watermark.lines *
+					 stream->cur_frame->bytesperline;
+
+	/* Deliver H.264/H.265 streams per NAL unit when enabled. */
+	stream->nal_active = stream->nal != NULL &&
+			     uvc_nal_format(stream->cur_format);
+	if (stream->nal_active)
+		uvc_nal_start(stream);
+}
+
+/*
+ * Submit the URBs allocated by uvc_init_video().
+ */
+static int uvc_video_submit(struct uvc_streaming *stream, gfp_t gfp_flags)
+{
+	unsigned long flags;
+	unsigned int i;
+	int ret;
+
+	/* Self-submitting operations start with all URBs parked and submit
+	 * them as buffers get queued.
+	 */
+	if (stream->ops->kick != NULL) {
+		spin_lock_irqsave(&stream->sg_out.lock, flags);
+		stream->sg_out.running = 1;
+		stream->sg_out.idle = BIT(UVC_URBS) - 1;
+		spin_unlock_irqrestore(&stream->sg_out.lock, flags);
+
+		stream->ops->kick(stream);
+		goto done;
+	}
+
+	/* Submit the URBs. */
+	for (i = 0; i < UVC_URBS; ++i) {
+		ret = usb_submit_urb(stream->urb[i], gfp_flags);
+		if (ret < 0) {
+			uvc_printk(KERN_ERR, "Failed to submit URB %u "
+					"(%d).\n", i, ret);
+			stream->ops->uninit(stream, 1);
+			return ret;
+		}
+	}
+
+done:
+	uvc_video_start_mark(stream, UVC_START_SUBMIT);
+
+	/* The Logitech C920 temporarily forgets that it should not be adjusting
+	 * Exposure Absolute during init so restore controls to stored values.
+	 */
+	if (stream->dev->quirks & UVC_QUIRK_RESTORE_CTRLS_ON_INIT)
+		uvc_ctrl_restore_values(stream->dev);
+
+	return 0;
+}
+
+static int uvc_init_video(struct uvc_streaming *stream, gfp_t gfp_flags)
+{
+	struct usb_interface *intf = stream->intf;
+	struct usb_host_endpoint *ep;
+	unsigned int i;
+	int ret;
+
+	uvc_video_start_run(stream);
+
+	if (intf->num_altsetting > 1) {
+		struct usb_host_endpoint *best_ep = NULL;
+		unsigned int best_psize = UINT_MAX;
+		unsigned int bandwidth;
+		unsigned int uninitialized_var(altsetting);
+		int intfnum = stream->intfnum;
+
+		/* Isochronous endpoint, select the alternate setting. */
+		bandwidth = stream->ctrl.dwMaxPayloadTransferSize;
+
+		if (bandwidth == 0) {
+			uvc_trace(UVC_TRACE_VIDEO, "Device requested null "
 				"bandwidth, defaulting to lowest.\n");
 			bandwidth = 1;
 		} else {
@@ -1432,11 +2605,13 @@ static int uvc_init_video(struct uvc_streaming *stream, gfp_t gfp_flags)
 		uvc_trace(UVC_TRACE_VIDEO, "Selecting alternate setting %u "
 			"(%u B/frame bandwidth).\n", altsetting, best_psize);
 
-		ret = usb_set_interface(stream->dev->udev, intfnum, altsetting);
+		ret = uvc_video_set_altsetting(stream, altsetting);
 		if (ret < 0)
 			return ret;
 
-		ret = uvc_init_video_isoc(stream, best_ep, gfp_flags);
+		uvc_video_start_mark(stream, UVC_START_ALTSETTING);
+		stream->standby.altsetting = altsetting;
+		ret = stream->ops->init(stream, best_ep, gfp_flags);
 	} else {
 		/* Bulk endpoint, proceed to URB initialization. */
 		ep = uvc_find_endpoint(&intf->altsetting[0],
@@ -1444,30 +2619,349 @@ static int uvc_init_video(struct uvc_streaming *stream, gfp_t gfp_flags)
 		if (ep == NULL)
 			return -EIO;
 
-		ret = uvc_init_video_bulk(stream, ep, gfp_flags);
+		stream->standby.altsetting = 0;
+		ret = stream->ops->init(stream, ep, gfp_flags);
 	}
 
 	if (ret < 0)
 		return ret;
 
-	/* Submit the URBs. */
+	uvc_video_start_mark(stream, UVC_START_URBS);
+
+	/* Remember what the URBs were sized for, for warm restarts. */
+	stream->standby.ready = 1;
+	stream->standby.payload_size = stream->ctrl.dwMaxPayloadTransferSize;
+	stream->standby.frame_size = stream->ctrl.dwMaxVideoFrameSize;
+
+	return uvc_video_submit(stream, gfp_flags);
+}
+
+
+/* --------------------------------------------------------------------------
+ * Warm standby
+ *
+ * With the standby module parameter set, stopping or suspending a capture
+ * stream only kills its URBs. The URBs, transfer buffers, clock samples and
+ * selected alternate setting are kept, and restarting the stream resubmits
+ * the URBs directly, as long as the committed payload and frame sizes still
+ * match what the URBs were allocated for. The time to first frame of cold
+ * and warm starts is reported with the start reports.
+ */
+
+static bool uvc_video_standby(struct uvc_streaming *stream)
+{
+	return uvc_standby_param &&
+	       stream->type == VIDEO_BUF_TYPE_VIDEO_CAPTURE;
+}
+
+/* Stop the stream, keeping the URBs and transfer buffers allocated. */
+static void uvc_video_park(struct uvc_streaming *stream)
+{
+	unsigned int i;
+
+	uvc_video_stats_stop(stream);
+
 	for (i = 0; i < UVC_URBS; ++i) {
-		ret = usb_submit_urb(stream->urb[i], gfp_flags);
-		if (ret < 0) {
-			uvc_printk(KERN_ERR, "Failed to submit URB %u "
-					"(%d).\n", i, ret);
-			uvc_uninit_video(stream, 1);
+		if (stream->urb[i] != NULL)
+			usb_kill_urb(stream->urb[i]);
+	}
+}
+
+/*
+ * Restart a parked stream. Return -EAGAIN if the URBs can't be reused and
+ * the stream must be initialized from scratch.
+ */
+static int uvc_video_warm_start(struct uvc_streaming *stream,
+		gfp_t gfp_flags, int set_alt)
+{
+	int ret;
+
+	if (!stream->standby.ready ||
+	    stream->standby.payload_size !=
+			stream->ctrl.dwMaxPayloadTransferSize ||
+	    stream->standby.frame_size != stream->ctrl.dwMaxVideoFrameSize)
+		return -EAGAIN;
+
+	uvc_video_start_run(stream);
+
+	if (set_alt && stream->standby.altsetting) {
+		ret = uvc_video_set_altsetting(stream,
+					       stream->standby.altsetting);
+		if (ret < 0)
 			return ret;
-		}
+
+		uvc_video_start_mark(stream, UVC_START_ALTSETTING);
 	}
 
-	/* The Logitech C920 temporarily forgets that it should not be adjusting
-	 * Exposure Absolute during init so restore controls to stored values.
+	stream->start.cur.warm = 1;
+	return uvc_video_submit(stream, gfp_flags);
+}
+
+/* Start the stream, warm if possible. */
+static int uvc_video_start(struct uvc_streaming *stream, gfp_t gfp_flags,
+		int set_alt)
+{
+	int ret;
+
+	if (uvc_video_standby(stream)) {
+		ret = uvc_video_warm_start(stream, gfp_flags, set_alt);
+		if (ret != -EAGAIN)
+			return ret;
+	}
+
+	/* Release parked URBs that can't be reused. */
+	if (stream->standby.ready)
+		stream->ops->uninit(stream, 1);
+
+	return uvc_init_video(stream, gfp_flags);
+}
+
+size_t uvc_video_standby_dump(struct uvc_streaming *stream, char *buf,
+			      size_t size)
+{
+	return scnprintf(buf, size, "enabled %u parked %u altsetting %u\n",
+			 uvc_video_standby(stream), stream->standby.ready,
+			 stream->standby.altsetting);
+}
+
+/*
+ * Free the resources kept for warm standby. Called when the device is
+ * deleted.
+ */
+void uvc_video_cleanup(struct uvc_streaming *stream)
+{
+	if (stream->standby.ready)
+		stream->ops->uninit(stream, 1);
+
+	uvc_video_clock_cleanup(stream);
+}
+
+/* --------------------------------------------------------------------------
+ * Output pacing
+ *
+ * Output buffers are held in a small jitter buffer and released to the
+ * transfer queue by an hrtimer, one per frame interval, instead of being sent
+ * as fast as the URBs complete. A frame is held back when the previous one
+ * hasn't been fully sent yet, so the device never receives frames faster than
+ * the negotiated frame rate.
+ *
+ * Counters: late ticks found no frame to release, early frames were refused
+ * because the jitter buffer was full, and stalls are ticks where the
+ * previous frame was still in flight.
+ */
+
+#define UVC_PACING_DEPTH	3
+
+/* Hand an output buffer to the transfer queue. */
+static int uvc_video_queue_transfer(struct uvc_streaming *stream,
+		struct uvc_buffer *buf)
+{
+	int ret;
+
+	ret = uvc_queue_buffer(&stream->queue, buf);
+	if (ret == 0 && stream->ops->kick != NULL)
+		stream->ops->kick(stream);
+
+	return ret;
+}
+
+static enum hrtimer_restart uvc_video_pacing_tick(struct hrtimer *timer)
+{
+	struct uvc_streaming *stream =
+		container_of(timer, struct uvc_streaming, pacing.timer);
+	struct uvc_buffer *buf = NULL;
+	unsigned long flags;
+
+	spin_lock_irqsave(&stream->pacing.lock, flags);
+
+	if (!uvc_queue_empty(&stream->queue)) {
+		stream->pacing.stalls++;
+	} else if (list_empty(&stream->pacing.pending)) {
+		stream->pacing.late++;
+	} else {
+		buf = list_first_entry(&stream->pacing.pending,
+				       struct uvc_buffer, queue);
+		list_del(&buf->queue);
+		stream->pacing.count--;
+		stream->pacing.released++;
+	}
+
+	spin_unlock_irqrestore(&stream->pacing.lock, flags);
+
+	if (buf != NULL && uvc_video_queue_transfer(stream, buf) < 0)
+		buf->state = UVC_BUF_STATE_ERROR;
+
+	hrtimer_forward_now(timer, stream->pacing.period);
+	return HRTIMER_RESTART;
+}
+
+/*
+ * Queue an output buffer. The buffer goes through the jitter buffer when
+ * pacing is active, and straight to the transfer queue otherwise. Return
+ * -EAGAIN if the jitter buffer is full.
+ *
+ * This is the entry point for in-kernel producers of output frames. The
+ * driver has no userspace output path that calls it.
+ */
+int uvc_video_queue_output(struct uvc_streaming *stream,
+		struct uvc_buffer *buf)
+{
+	unsigned long flags;
+	int ret = 0;
+
+	if (!stream->pacing.active)
+		return uvc_video_queue_transfer(stream, buf);
+
+	spin_lock_irqsave(&stream->pacing.lock, flags);
+	if (stream->pacing.count >= UVC_PACING_DEPTH) {
+		stream->pacing.early++;
+		ret = -EAGAIN;
+	} else {
+		buf->state = UVC_BUF_STATE_QUEUED;
+		list_add_tail(&buf->queue, &stream->pacing.pending);
+		stream->pacing.count++;
+	}
+	spin_unlock_irqrestore(&stream->pacing.lock, flags);
+
+	return ret;
+}
+
+static void uvc_video_pacing_start(struct uvc_streaming *stream)
+{
+	u32 interval = stream->ctrl.dwFrameInterval;
+
+	if (!uvc_pacing_param || stream->type != VIDEO_BUF_TYPE_VIDEO_OUTPUT ||
+	    interval == 0)
+		return;
+
+	/* dwFrameInterval is expressed in 100ns units. */
+	stream->pacing.period = ns_to_ktime((u64)interval * 100);
+	stream->pacing.active = 1;
+	hrtimer_start(&stream->pacing.timer, stream->pacing.period,
+		      HRTIMER_MODE_REL);
+}
+
+static void uvc_video_pacing_stop(struct uvc_streaming *stream)
+{
+	struct uvc_buffer *buf, *next;
+	unsigned long flags;
+
+	if (!stream->pacing.active)
+		return;
+
+	hrtimer_cancel(&stream->pacing.timer);
+	stream->pacing.active = 0;
+
+	/* Hand the frames that were never released back as errors. */
+	spin_lock_irqsave(&stream->pacing.lock, flags);
+	list_for_each_entry_safe(buf, next, &stream->pacing.pending, queue) {
+		list_del(&buf->queue);
+		buf->state = UVC_BUF_STATE_ERROR;
+	}
+	stream->pacing.count = 0;
+	spin_unlock_irqrestore(&stream->pacing.lock, flags);
+}
+
+size_t uvc_video_pacing_dump(struct uvc_streaming *stream, char *buf,
+			     size_t size)
+{
+	unsigned long flags;
+	size_t count;
+
+	spin_lock_irqsave(&stream->pacing.lock, flags);
+	count = scnprintf(buf, size,
+			  "active %u period %lld ns queued %u\n"
+			  "released %u late %u early %u stalls %u\n",
+			  stream->pacing.active,
+			  ktime_to_ns(stream->pacing.period),
+			  stream->pacing.count, stream->pacing.released,
+			  stream->pacing.late, stream->pacing.early,
+			  stream->pacing.stalls);
+	spin_unlock_irqrestore(&stream->pacing.lock, flags);
+
+	return count;
+}
+
+/* --------------------------------------------------------------------------
+ * Transfer operations
+ *
+ * Streams are driven by an operations table selected by uvc_video_init()
+ * from the stream direction and endpoint type. Capture streams use one of
+ * the specialized decode variants, picked at stream start.
+ */
+
+static const struct uvc_video_ops uvc_video_ops[] = {
+	{
+		.type		= VIDEO_BUF_TYPE_VIDEO_CAPTURE,
+		.xfer		= USB_ENDPOINT_XFER_ISOC,
+		.variants	= uvc_video_decode_isoc_variants,
+		.init		= uvc_init_video_isoc,
+		.uninit		= uvc_uninit_video,
+	},
+	{
+		.type		= VIDEO_BUF_TYPE_VIDEO_CAPTURE,
+		.xfer		= USB_ENDPOINT_XFER_BULK,
+		.variants	= uvc_video_decode_bulk_variants,
+		.init		= uvc_init_video_bulk,
+		.uninit		= uvc_uninit_video,
+	},
+	{
+		.type		= VIDEO_BUF_TYPE_VIDEO_OUTPUT,
+		.xfer		= USB_ENDPOINT_XFER_BULK,
+		.sg		= 1,
+		.decode		= uvc_video_encode_bulk_sg,
+		.init		= uvc_init_video_bulk_sg,
+		.uninit		= uvc_uninit_video_sg,
+		.kick		= uvc_video_kick_sg,
+	},
+	{
+		.type		= VIDEO_BUF_TYPE_VIDEO_OUTPUT,
+		.xfer		= USB_ENDPOINT_XFER_BULK,
+		.decode		= uvc_video_encode_bulk,
+		.init		= uvc_init_video_bulk,
+		.uninit		= uvc_uninit_video,
+	},
+};
+
+/* The built-in iSight uses a proprietary payload format. */
+static const struct uvc_video_ops uvc_video_isight_ops = {
+	.type		= VIDEO_BUF_TYPE_VIDEO_CAPTURE,
+	.xfer		= USB_ENDPOINT_XFER_ISOC,
+	.decode		= uvc_video_decode_isight,
+	.init		= uvc_init_video_isoc,
+	.uninit		= uvc_uninit_video,
+};
+
+/*
+ * Streaming interfaces with alternate settings use isochronous endpoints,
+ * others use a bulk endpoint.
+ */
+static const struct uvc_video_ops *
+uvc_video_find_ops(struct uvc_streaming *stream)
+{
+	struct usb_bus *bus = stream->dev->udev->bus;
+	int xfer = stream->intf->num_altsetting > 1
+		 ? USB_ENDPOINT_XFER_ISOC : USB_ENDPOINT_XFER_BULK;
+	unsigned int i;
+
+	if (stream->dev->quirks & UVC_QUIRK_BUILTIN_ISIGHT)
+		return &uvc_video_isight_ops;
+
+	/* Entries are ordered by preference. Scatter-gather entries require a
+	 * host controller accepting segments of any size, see
+	 * uvc_video_encode_bulk_sg().
 	 */
-	if (stream->dev->quirks & UVC_QUIRK_RESTORE_CTRLS_ON_INIT)
-		uvc_ctrl_restore_values(stream->dev);
+	for (i = 0; i < ARRAY_SIZE(uvc_video_ops); ++i) {
+		if (uvc_video_ops[i].sg && (!bus->sg_tablesize ||
+					    !bus->no_sg_constraint))
+			continue;
 
-	return 0;
+		if (uvc_video_ops[i].type == stream->type &&
+		    uvc_video_ops[i].xfer == xfer)
+			return &uvc_video_ops[i];
+	}
+
+	return NULL;
 }
 
 /* --------------------------------------------------------------------------
@@ -1485,10 +2979,22 @@ static int uvc_init_video(struct uvc_streaming *stream, gfp_t gfp_flags)
 //complete //from uvc_driver 
 int uvc_video_suspend(struct uvc_streaming *stream)
 {
+	/* The recovery handler takes the mutex, cancel it first. */
+	cancel_work_sync(&stream->recovery.work);
+
+	mutex_lock(&stream->mutex);
 
 	stream->frozen = 1;
-	uvc_uninit_video(stream, 0);
-	usb_set_interface(stream->dev->udev, stream->intfnum, 0);
+
+	/* Keep the alternate setting, the device retains it while suspended. */
+	if (uvc_video_standby(stream)) {
+		uvc_video_park(stream);
+	} else {
+		stream->ops->uninit(stream, 0);
+		uvc_video_set_altsetting(stream, 0);
+	}
+
+	mutex_unlock(&stream->mutex);
 	return 0;
 }
 
@@ -1498,32 +3004,53 @@ int uvc_video_resume(struct uvc_streaming *stream, int reset)
 {
 	int ret;
 
+	cancel_work_sync(&stream->recovery.work);
+
+	mutex_lock(&stream->mutex);
+
 	if (reset)
 		usb_set_interface(stream->dev->udev, stream->intfnum, 0);
 
 	stream->frozen = 0;
 
+	uvc_video_start_begin(stream);
 	uvc_video_clock_reset(stream);
+	uvc_video_start_mark(stream, UVC_START_CLOCK);
+
+	/* A parked stream only needs its URBs resubmitted. */
+	if (!reset && uvc_video_standby(stream)) {
+		ret = uvc_video_warm_start(stream, GFP_NOIO, 0);
+		if (ret != -EAGAIN)
+			goto done;
+	}
 
 	ret = uvc_commit_video(stream, &stream->ctrl);
 	if (ret < 0)
-		return ret;
+		goto done;
+
+	uvc_video_start_mark(stream, UVC_START_COMMIT);
 
-	return uvc_init_video(stream, GFP_NOIO);
+	ret = uvc_video_start(stream, GFP_NOIO, 1);
+
+done:
+	mutex_unlock(&stream->mutex);
+	return ret;
 }
 
 /* ------------------------------------------------------------------------
  * Video device
  */
 
+static void uvc_video_recovery_work(struct work_struct *work);
+static void uvc_video_recovery_cancel(struct uvc_streaming *stream);
+
 
 // complete // from uvc_driver
 int uvc_video_init(struct uvc_streaming *stream)
 {
     struct uvc_streaming_control *probe = &stream->ctrl;
-    struct uvc_format *format = NULL;
-    struct uvc_frame *frame = NULL;
-    unsigned int i;
+    struct uvc_format *format;
+    struct uvc_frame *frame;
     int ret;
 
     if (stream->nformats == 0) {
@@ -1533,23 +3060,40 @@ int uvc_video_init(struct uvc_streaming *stream)
 
     atomic_set(&stream->active, 0);
 
+    spin_lock_init(&stream->recovery.lock);
+    INIT_WORK(&stream->recovery.work, uvc_video_recovery_work);
+
+    spin_lock_init(&stream->urb_errors.lock);
+    INIT_DELAYED_WORK(&stream->urb_errors.work, uvc_video_urb_errors_work);
+
+    spin_lock_init(&stream->pacing.lock);
+    spin_lock_init(&stream->sg_out.lock);
+    INIT_LIST_HEAD(&stream->pacing.pending);
+    hrtimer_init(&stream->pacing.timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    stream->pacing.timer.function = uvc_video_pacing_tick;
+
     usb_set_interface(stream->dev->udev, stream->intfnum, 0);
 
-    if (uvc_get_video_ctrl(stream, probe, 1, UVC_GET_DEF) == 0)
-        uvc_set_video_ctrl(stream, probe, 1);
+    /* The default probe control is negotiated once per device model, see
+     * the probe cache in uvc_driver.c.
+     */
+    if (uvc_probe_cache_get_ctrl(stream, probe) < 0) {
+        if (uvc_get_video_ctrl(stream, probe, 1, UVC_GET_DEF) == 0)
+            uvc_set_video_ctrl(stream, probe, 1);
+
+        ret = uvc_get_video_ctrl(stream, probe, 1, UVC_GET_CUR);
+        if (ret < 0)
+            return ret;
 
-    ret = uvc_get_video_ctrl(stream, probe, 1, UVC_GET_CUR);
-    if (ret < 0)
-        return ret;
+        uvc_probe_cache_put_ctrl(stream, probe);
+    }
 
     /* Check if the default format descriptor exists. Use the first
      * available format otherwise.
      */
-    for (i = stream->nformats; i > 0; --i) {
-        format = &stream->format[i-1];
-        if (format->index == probe->bFormatIndex)
-            break;
-    }
+    format = uvc_format_by_index(stream, probe->bFormatIndex);
+    if (format == NULL)
+        format = &stream->format[0];
 
     if (format->nframes == 0) {
         uvc_printk(KERN_INFO, "No frame descriptor found for the "
@@ -1562,11 +3106,9 @@ int uvc_video_init(struct uvc_streaming *stream)
      * descriptor with bFrameIndex set to zero. If the default frame
      * descriptor is not found, use the first available frame.
      */
-    for (i = format->nframes; i > 0; --i) {
-        frame = &format->frame[i-1];
-        if (frame->bFrameIndex == probe->bFrameIndex)
-            break;
-    }
+    frame = uvc_frame_by_index(format, probe->bFrameIndex);
+    if (frame == NULL)
+        frame = &format->frame[0];
 
     probe->bFormatIndex = format->index;
     probe->bFrameIndex = frame->bFrameIndex;
@@ -1575,22 +3117,40 @@ int uvc_video_init(struct uvc_streaming *stream)
     stream->cur_format = format;
     stream->cur_frame = frame;
 
-    /* Select the video decoding function */
-    if (stream->dev->quirks & UVC_QUIRK_BUILTIN_ISIGHT)
-        stream->decode = uvc_video_decode_isight;
-    else if (stream->intf->num_altsetting > 1)
-        stream->decode = uvc_video_decode_isoc;
-    else
-        stream->decode = uvc_video_decode_bulk;
-    if (stream->intf->num_altsetting == 1)
-        stream->decode = uvc_video_encode_bulk;
-    else {
+    /* Preallocate the NAL streaming pool if any format can use it. */
+    if (uvc_nal_param && stream->nal == NULL) {
+        unsigned int i;
+
+        for (i = 0; i < stream->nformats; ++i) {
+            if (!uvc_nal_format(&stream->format[i]))
+                continue;
+
+            ret = uvc_nal_init(stream);
+            if (ret < 0)
+                return ret;
+            break;
+        }
+    }
+
+    /* Select the transfer operations for the stream direction and
+     * endpoint type.
+     */
+    stream->ops = uvc_video_find_ops(stream);
+    if (stream->ops == NULL) {
         uvc_printk(KERN_INFO, "Isochronous endpoints are not "
                 "supported for video output devices.\n");
         return -EINVAL;
     }
 
-    return 0;
+    if (stream->ops->variants != NULL)
+        stream->decode = stream->ops->variants[0];
+    else
+        stream->decode = stream->ops->decode;
+
+    /* Preallocate the clock samples to keep them out of the stream start
+     * path. They're freed by uvc_video_cleanup().
+     */
+    return uvc_video_clock_init(stream);
 }
 
 /*
@@ -1603,10 +3163,15 @@ int uvc_video_enable(struct uvc_streaming *stream, int enable)
 	int ret;
 
 	if (!enable) {
-		uvc_uninit_video(stream, 1);
+		stream->streaming = 0;
+		uvc_video_recovery_cancel(stream);
+		uvc_video_pacing_stop(stream);
+		if (uvc_video_standby(stream))
+			uvc_video_park(stream);
+		else
+			stream->ops->uninit(stream, 1);
 		if (stream->intf->num_altsetting > 1) {
-			usb_set_interface(stream->dev->udev,
-					  stream->intfnum, 0);
+			uvc_video_set_altsetting(stream, 0);
 		} else {
 			unsigned int epnum = stream->header.bEndpointAddress
 					   & USB_ENDPOINT_NUMBER_MASK;
@@ -1618,7 +3183,6 @@ int uvc_video_enable(struct uvc_streaming *stream, int enable)
 			usb_clear_halt(stream->dev->udev, pipe);
 		}
 
-		uvc_video_clock_cleanup(stream);
 /*------------- kthread stop------- */	
  //     flag=1;
  //   kthread_stop(mythread);
@@ -1626,25 +3190,215 @@ int uvc_video_enable(struct uvc_streaming *stream, int enable)
       return 0;
    }
 
+	uvc_video_start_begin(stream);
+
+	/* The clock samples are preallocated by uvc_video_init(). */
 	ret = uvc_video_clock_init(stream);
 	if (ret < 0)
 		return ret;
 
+	uvc_video_start_mark(stream, UVC_START_CLOCK);
+
 	/* Commit the streaming parameters. */
 	ret = uvc_commit_video(stream, &stream->ctrl);
 	if (ret < 0)
-		goto error_commit;
+		return ret;
 
-	ret = uvc_init_video(stream, GFP_KERNEL);
-	if (ret < 0)
-		goto error_video;
+	uvc_video_start_mark(stream, UVC_START_COMMIT);
+
+	ret = uvc_video_start(stream, GFP_KERNEL, 1);
+	if (ret < 0) {
+		uvc_video_set_altsetting(stream, 0);
+		return ret;
+	}
+
+	uvc_video_pacing_start(stream);
+	stream->streaming = 1;
 
 	return 0;
+}
 
-error_video:
-	usb_set_interface(stream->dev->udev, stream->intfnum, 0);
-error_commit:
-	uvc_video_clock_cleanup(stream);
+/* --------------------------------------------------------------------------
+ * Stream recovery
+ *
+ * Stream error status events, URBs completing with an error and sustained
+ * isochronous packet loss schedule the recovery work handler, which applies
+ * the cheapest action first. A new error reported within
+ * UVC_RECOVERY_ESCALATE_MS of an action means the action didn't help, and
+ * escalates to the next, more expensive, one.
+ */
 
-	return ret;
+static const char *uvc_recovery_action_names[UVC_RECOVERY_NR_ACTIONS] = {
+	"resync",
+	"commit",
+	"altsetting",
+	"restart",
+};
+
+static const char *uvc_recovery_reason_names[UVC_RECOVERY_NR_REASONS] = {
+	"event",
+	"iso",
+	"urb",
+};
+
+/*
+ * Request stream recovery. Can be called from interrupt context.
+ */
+void uvc_video_recover(struct uvc_streaming *stream,
+		enum uvc_recovery_reason reason)
+{
+	unsigned int action = UVC_RECOVERY_RESYNC;
+	unsigned long flags;
+
+	/* A failed URB isn't resubmitted, the URBs must be reinitialized. */
+	if (reason == UVC_RECOVERY_REASON_URB)
+		action = UVC_RECOVERY_ALTSETTING;
+
+	spin_lock_irqsave(&stream->recovery.lock, flags);
+	stream->recovery.triggers[reason]++;
+	stream->recovery.pending = 1;
+	stream->recovery.min_action = max(stream->recovery.min_action, action);
+	spin_unlock_irqrestore(&stream->recovery.lock, flags);
+
+	schedule_work(&stream->recovery.work);
+}
+
+/*
+ * Drop pending recovery requests when the stream is stopped. This can be
+ * called from the recovery handler itself, don't wait for it: a work item
+ * that is still queued will find nothing pending and return.
+ */
+static void uvc_video_recovery_cancel(struct uvc_streaming *stream)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&stream->recovery.lock, flags);
+	stream->recovery.pending = 0;
+	stream->recovery.min_action = 0;
+	spin_unlock_irqrestore(&stream->recovery.lock, flags);
+}
+
+static int uvc_video_recovery_action(struct uvc_streaming *stream,
+		unsigned int action)
+{
+	int ret;
+
+	switch (action) {
+	case UVC_RECOVERY_RESYNC:
+		atomic_set(&stream->recovery.resync, 1);
+		return 0;
+
+	case UVC_RECOVERY_COMMIT:
+		return uvc_commit_video(stream, &stream->ctrl);
+
+	case UVC_RECOVERY_ALTSETTING:
+		/* Keep the buffers queued while the URBs are killed. */
+		stream->frozen = 1;
+		stream->ops->uninit(stream, 0);
+		usb_set_interface(stream->dev->udev, stream->intfnum, 0);
+		stream->frozen = 0;
+
+		uvc_video_start_begin(stream);
+		ret = uvc_commit_video(stream, &stream->ctrl);
+		if (ret < 0)
+			return ret;
+
+		uvc_video_start_mark(stream, UVC_START_COMMIT);
+		return uvc_init_video(stream, GFP_NOIO);
+
+	case UVC_RECOVERY_RESTART:
+	default:
+		stream->frozen = 1;
+		uvc_video_enable(stream, 0);
+		stream->frozen = 0;
+
+		return uvc_video_enable(stream, 1);
+	}
+}
+
+static void uvc_video_recovery_work(struct work_struct *work)
+{
+	struct uvc_streaming *stream = container_of(work, struct uvc_streaming,
+						    recovery.work);
+	struct uvc_recovery_stats *stats;
+	unsigned long flags;
+	unsigned int action;
+	bool pending;
+	int ret;
+
+	mutex_lock(&stream->mutex);
+
+	spin_lock_irqsave(&stream->recovery.lock, flags);
+	pending = stream->recovery.pending;
+	action = stream->recovery.min_action;
+	stream->recovery.pending = 0;
+	stream->recovery.min_action = 0;
+	spin_unlock_irqrestore(&stream->recovery.lock, flags);
+
+	/* Nothing to recover if the request has been cancelled, or if the
+	 * stream has been stopped or suspended meanwhile.
+	 */
+	if (!pending || !stream->streaming || stream->frozen)
+		goto done;
+
+	/* Nor if the device has been unplugged. */
+	if (uvc_video_device_gone(stream, 0))
+		goto done;
+
+	if (stream->recovery.last_jiffies &&
+	    time_before(jiffies, stream->recovery.last_jiffies +
+			msecs_to_jiffies(UVC_RECOVERY_ESCALATE_MS)))
+		action = max(action, stream->recovery.last_action + 1);
+	action = min_t(unsigned int, action, UVC_RECOVERY_RESTART);
+
+	ret = uvc_video_recovery_action(stream, action);
+
+	stats = &stream->recovery.actions[action];
+	stats->count++;
+	stats->last_result = ret;
+	ktime_get_ts(&stats->last_ts);
+
+	stream->recovery.last_action = action;
+	stream->recovery.last_jiffies = jiffies;
+
+	uvc_printk(ret < 0 ? KERN_ERR : KERN_INFO, "Stream %u recovery: %s "
+		   "(%d).\n", stream->intfnum,
+		   uvc_recovery_action_names[action], ret);
+
+done:
+	mutex_unlock(&stream->mutex);
+}
+
+size_t uvc_video_recovery_dump(struct uvc_streaming *stream, char *buf,
+			       size_t size)
+{
+	struct uvc_recovery_stats *stats;
+	unsigned int triggers[UVC_RECOVERY_NR_REASONS];
+	unsigned long flags;
+	size_t count = 0;
+	unsigned int i;
+
+	spin_lock_irqsave(&stream->recovery.lock, flags);
+	memcpy(triggers, stream->recovery.triggers, sizeof(triggers));
+	spin_unlock_irqrestore(&stream->recovery.lock, flags);
+
+	for (i = 0; i < UVC_RECOVERY_NR_REASONS; ++i)
+		count += scnprintf(buf + count, size - count,
+				   "trigger %-10s %u\n",
+				   uvc_recovery_reason_names[i], triggers[i]);
+
+	mutex_lock(&stream->mutex);
+	for (i = 0; i < UVC_RECOVERY_NR_ACTIONS; ++i) {
+		stats = &stream->recovery.actions[i];
+		count += scnprintf(buf + count, size - count,
+				   "action  %-10s %u last %lu.%06lu (%d)\n",
+				   uvc_recovery_action_names[i], stats->count,
+				   (unsigned long)stats->last_ts.tv_sec,
+				   (unsigned long)stats->last_ts.tv_nsec /
+				   NSEC_PER_USEC,
+				   stats->last_result);
+	}
+	mutex_unlock(&stream->mutex);
+
+	return count;
 }
@@ -6,12 +6,17 @@
 #error "The uvcvideo.h header is deprecated, use linux/uvcvideo.h instead."
 #endif /* __KERNEL__ */
 
+#include <linux/completion.h>
+#include <linux/hashtable.h>
+#include <linux/hrtimer.h>
 #include <linux/kernel.h>
+#include <linux/kfifo.h>
 #include <linux/poll.h>
 #include <linux/usb.h>
 #include <linux/usb/video.h>
 #include <linux/uvcvideo.h>
 #include <linux/videodev2.h>
+#include <linux/workqueue.h>
 #include <media/media-device.h>
 #include "video_cntrl.h"
 
@@ -62,6 +67,54 @@
 #define UVC_GUID_FORMAT_YUY2 \
 	{ 'Y',  'U',  'Y',  '2', 0x00, 0x00, 0x10, 0x00, \
 	 0x80, 0x00, 0x00, 0xaa, 0x00, 0x38, 0x9b, 0x71}
+#define UVC_GUID_FORMAT_UYVY \
+	{ 'U',  'Y',  'V',  'Y', 0x00, 0x00, 0x10, 0x00, \
+	 0x80, 0x00, 0x00, 0xaa, 0x00, 0x38, 0x9b, 0x71}
+#define UVC_GUID_FORMAT_NV12 \
+	{ 'N',  'V',  '1',  '2', 0x00, 0x00, 0x10, 0x00, \
+	 0x80, 0x00, 0x00, 0xaa, 0x00, 0x38, 0x9b, 0x71}
+#define UVC_GUID_FORMAT_YV12 \
+	{ 'Y',  'V',  '1',  '2', 0x00, 0x00, 0x10, 0x00, \
+	 0x80, 0x00, 0x00, 0xaa, 0x00, 0x38, 0x9b, 0x71}
+#define UVC_GUID_FORMAT_I420 \
+	{ 'I',  '4',  '2',  '0', 0x00, 0x00, 0x10, 0x00, \
+	 0x80, 0x00, 0x00, 0xaa, 0x00, 0x38, 0x9b, 0x71}
+#define UVC_GUID_FORMAT_Y800 \
+	{ 'Y',  '8',  '0',  '0', 0x00, 0x00, 0x10, 0x00, \
+	 0x80, 0x00, 0x00, 0xaa, 0x00, 0x38, 0x9b, 0x71}
+#define UVC_GUID_FORMAT_Y8 \
+	{ 'Y',  '8',  ' ',  ' ', 0x00, 0x00, 0x10, 0x00, \
+	 0x80, 0x00, 0x00, 0xaa, 0x00, 0x38, 0x9b, 0x71}
+#define UVC_GUID_FORMAT_Y10 \
+	{ 'Y',  '1',  '0',  ' ', 0x00, 0x00, 0x10, 0x00, \
+	 0x80, 0x00, 0x00, 0xaa, 0x00, 0x38, 0x9b, 0x71}
+#define UVC_GUID_FORMAT_Y12 \
+	{ 'Y',  '1',  '2',  ' ', 0x00, 0x00, 0x10, 0x00, \
+	 0x80, 0x00, 0x00, 0xaa, 0x00, 0x38, 0x9b, 0x71}
+#define UVC_GUID_FORMAT_Y16 \
+	{ 'Y',  '1',  '6',  ' ', 0x00, 0x00, 0x10, 0x00, \
+	 0x80, 0x00, 0x00, 0xaa, 0x00, 0x38, 0x9b, 0x71}
+#define UVC_GUID_FORMAT_RGBP \
+	{ 'R',  'G',  'B',  'P', 0x00, 0x00, 0x10, 0x00, \
+	 0x80, 0x00, 0x00, 0xaa, 0x00, 0x38, 0x9b, 0x71}
+#define UVC_GUID_FORMAT_BGR3 \
+	{0x7d, 0xeb, 0x36, 0xe4, 0x4f, 0x52, 0xce, 0x11, \
+	 0x9f, 0x53, 0x00, 0x20, 0xaf, 0x0b, 0xa7, 0x70}
+#define UVC_GUID_FORMAT_H264 \
+	{ 'H',  '2',  '6',  '4', 0x00, 0x00, 0x10, 0x00, \
+	 0x80, 0x00, 0x00, 0xaa, 0x00, 0x38, 0x9b, 0x71}
+#define UVC_GUID_FORMAT_H265 \
+	{ 'H',  '2',  '6',  '5', 0x00, 0x00, 0x10, 0x00, \
+	 0x80, 0x00, 0x00, 0xaa, 0x00, 0x38, 0x9b, 0x71}
+#define UVC_GUID_FORMAT_Z16 \
+	{ 'Z',  '1',  '6',  ' ', 0x00, 0x00, 0x10, 0x00, \
+	 0x80, 0x00, 0x00, 0xaa, 0x00, 0x38, 0x9b, 0x71}
+#define UVC_GUID_FORMAT_INVZ \
+	{ 'I',  'N',  'V',  'Z', 0x90, 0x2d, 0x58, 0x4a, \
+	 0x92, 0x0b, 0x77, 0x3f, 0x1f, 0x2c, 0x55, 0x6b}
+#define UVC_GUID_FORMAT_INVI \
+	{ 'I',  'N',  'V',  'I', 0xdb, 0x57, 0x49, 0x5e, \
+	 0x8e, 0x3f, 0xf4, 0x79, 0x53, 0x2b, 0x94, 0x6f}
 
 
 /* ------------------------------------------------------------------------
@@ -76,8 +129,33 @@
 /* Maximum number of packets per URB. */
 #define UVC_MAX_PACKETS		32
 
+/* Number of consecutive isochronous URBs with a majority of lost packets, and
+ * of consecutive failed URBs, triggering stream recovery, and delay after a
+ * recovery action during which a new error escalates to the next action.
+ */
+#define UVC_RECOVERY_ISO_THRESHOLD	8
+#define UVC_RECOVERY_URB_THRESHOLD	4
+#define UVC_RECOVERY_ESCALATE_MS	2000
+
+/* Minimum interval between two URB error summaries. */
+#define UVC_URB_ERRORS_INTERVAL_MS	5000
+
+/* NAL streaming chunk pool. Chunks fit in a 4kB allocation. */
+#define UVC_NAL_CHUNKS		256
+#define UVC_NAL_CHUNK_SIZE	4032
+#define UVC_NAL_UNITS		64
+
+/* Static scene detection signature, one sample every UVC_DEDUP_STRIDE
+ * bytes, summed over UVC_DEDUP_BLOCKS bands of the frame.
+ */
+#define UVC_DEDUP_BLOCKS	64
+#define UVC_DEDUP_STRIDE	256
+
 /* Maximum status buffer size in bytes of interrupt URB. */
 #define UVC_MAX_STATUS_SIZE	16
+/* Number of status URBs and size of the received status packets FIFO. */
+#define UVC_STATUS_URBS		2
+#define UVC_STATUS_FIFO_SIZE	32
 
 #define UVC_CTRL_CONTROL_TIMEOUT	500
 #define UVC_CTRL_STREAMING_TIMEOUT	5000
@@ -103,6 +181,10 @@
 #define UVC_FMT_FLAG_COMPRESSED		0x00000001
 #define UVC_FMT_FLAG_STREAM		0x00000002
 
+/* Format decode hints */
+#define UVC_FMT_HINT_FIXED_SIZE		0x00000001	/* Frame size is bytesperline * height */
+#define UVC_FMT_HINT_DIRECT		0x00000002	/* Payload is copied to the buffer as-is */
+
 
 // added
 
@@ -110,6 +192,19 @@
       ((__u32)(a) | ((__u32)(b) << 8) | ((__u32)(c) << 16) | ((__u32)(d) << 24))
 #define VIDEO_PIX_FMT_YUYV    video_fourcc('Y', 'U', 'Y', 'V') /* 16  YUV 4:2:2 */ 
 
+#define VIDEO_PIX_FMT_UYVY    video_fourcc('U', 'Y', 'V', 'Y') /* 16  YUV 4:2:2 */
+#define VIDEO_PIX_FMT_NV12    video_fourcc('N', 'V', '1', '2') /* 12  Y/CbCr 4:2:0 */
+#define VIDEO_PIX_FMT_YVU420  video_fourcc('Y', 'V', '1', '2') /* 12  YVU 4:2:0 */
+#define VIDEO_PIX_FMT_YUV420  video_fourcc('Y', 'U', '1', '2') /* 12  YUV 4:2:0 */
+#define VIDEO_PIX_FMT_GREY    video_fourcc('G', 'R', 'E', 'Y') /*  8  Greyscale */
+#define VIDEO_PIX_FMT_Y10     video_fourcc('Y', '1', '0', ' ') /* 10  Greyscale */
+#define VIDEO_PIX_FMT_Y12     video_fourcc('Y', '1', '2', ' ') /* 12  Greyscale */
+#define VIDEO_PIX_FMT_Y16     video_fourcc('Y', '1', '6', ' ') /* 16  Greyscale */
+#define VIDEO_PIX_FMT_RGB565  video_fourcc('R', 'G', 'B', 'P') /* 16  RGB-5-6-5 */
+#define VIDEO_PIX_FMT_BGR24   video_fourcc('B', 'G', 'R', '3') /* 24  BGR-8-8-8 */
+#define VIDEO_PIX_FMT_Z16     video_fourcc('Z', '1', '6', ' ') /* 16  Depth */
+#define VIDEO_PIX_FMT_H264    video_fourcc('H', '2', '6', '4') /* H264 with start codes */
+#define VIDEO_PIX_FMT_HEVC    video_fourcc('H', 'E', 'V', 'C') /* HEVC with start codes */
 #define VIDEO_PIX_FMT_MJPEG    video_fourcc('M', 'J', 'P', 'G') /* Motion-JPEG   */
 
 
@@ -119,6 +214,7 @@
  */
 
 struct uvc_device;
+struct uvc_events;
 
 /* TODO: Put the most frequently accessed fields at the beginning of
  * structures to maximize cache efficiency.
@@ -185,23 +281,83 @@ struct uvc_control_mapping {
 
 struct uvc_control {
 	struct uvc_entity *entity;
+	struct uvc_video_chain *chain;	/* NULL if not part of a chain */
 	struct uvc_control_info info;
 
 	__u8 index;	/* Used to match the uvc_control entry with a
 			   uvc_control_info. */
+	struct hlist_node hash;		/* dev->ctrl_hash entry */
 	__u8 dirty:1,
 	     loaded:1,
 	     modified:1,
 	     cached:1,
+	     def_loaded:1,
 	     initialized:1;
 
+	/* Asynchronous SET_CUR state, protected by dev->async_ctrl.lock. */
+	struct list_head async;
+	bool async_queued;
+	bool async_failed;
+	bool async_written;
+	/* Generation of a value cached from a status event. */
+	unsigned int status_gen;
+
 	__u8 *uvc_data;
 };
 
+/* Binary layout of the control snapshot returned by uvc_ctrl_snapshot(). The
+ * header is followed by 'count' entries, each of them immediately followed by
+ * five values of 'size' bytes in the CUR, MIN, MAX, RES, DEF order. Values
+ * not reported by the device are zeroed and their bit cleared in 'valid'.
+ */
+#define UVC_CTRL_SNAPSHOT_VERSION	1
+
+#define UVC_CTRL_SNAPSHOT_CUR		(1 << 0)
+#define UVC_CTRL_SNAPSHOT_MIN		(1 << 1)
+#define UVC_CTRL_SNAPSHOT_MAX		(1 << 2)
+#define UVC_CTRL_SNAPSHOT_RES		(1 << 3)
+#define UVC_CTRL_SNAPSHOT_DEF		(1 << 4)
+
+struct uvc_ctrl_snapshot_header {
+	__u32 version;
+	__u32 count;
+} __packed;
+
+struct uvc_ctrl_snapshot_entry {
+	__u8 entity;
+	__u8 selector;
+	__u16 size;
+	__u32 flags;
+	__u8 valid;
+	__u8 reserved[3];
+} __packed;
+
+/* Status event read from the /dev/uvceventN character device. 'data' holds
+ * the raw status packet as sent by the device, 'timestamp' the reception
+ * time in nanoseconds (CLOCK_MONOTONIC) and 'dropped' the number of events
+ * lost before this one because the ring was full.
+ */
+struct uvc_status_event {
+	__u64 timestamp;
+	__u32 dropped;
+	__u8 length;
+	__u8 reserved[3];
+	__u8 data[UVC_MAX_STATUS_SIZE];
+} __packed;
+
+/* Status packet queued by the status URB completion handler. */
+struct uvc_status_packet {
+	u64 timestamp;
+	unsigned int length;
+	__u8 data[UVC_MAX_STATUS_SIZE];
+};
+
 struct uvc_format_desc {
 	char *name;
 	__u8 guid[16];
 	__u32 fcc;
+	__u32 hints;		/* UVC_FMT_HINT_* */
+	__u8 bpl_depth;		/* Bits per pixel of the first plane's lines */
 };
 
 /* The term 'entity' refers to both UVC units and UVC terminals.
@@ -353,6 +509,7 @@ struct uvc_frame {
 	__u8  bFrameIntervalType;
 	__u32 dwDefaultFrameInterval;
 	__u32 *dwFrameInterval;
+	__u32 bytesperline;	/* 0 if unknown or variable */
 };
 
 struct uvc_format {
@@ -362,11 +519,16 @@ struct uvc_format {
 	__u8 colorspace;
 	__u32 fcc;
 	__u32 flags;
+	__u32 hints;
 
 	char name[32];
 
 	unsigned int nframes;
 	struct uvc_frame *frame;
+
+	/* Frames indexed by bFrameIndex, see uvc_frame_by_index(). */
+	unsigned int nframe_index;
+	struct uvc_frame **frame_by_index;
 };
 
 struct uvc_streaming_header {
@@ -391,6 +553,34 @@ enum uvc_buffer_state {
 	UVC_BUF_STATE_ERROR	= 5,
 };
 
+/* Causes of frame corruption, see struct uvc_buffer_loss. */
+#define UVC_LOSS_USB_STATUS	(1 << 0)	/* Packet lost on the bus */
+#define UVC_LOSS_ERR_BIT	(1 << 1)	/* Payload header ERR bit set */
+#define UVC_LOSS_OVERFLOW	(1 << 2)	/* Frame larger than the buffer */
+#define UVC_LOSS_SIZE		(1 << 3)	/* Frame size mismatch */
+#define UVC_LOSS_RESYNC		(1 << 4)	/* Cut short by stream recovery */
+#define UVC_LOSS_REPEATED	(1 << 5)	/* Stands for the last good frame */
+#define UVC_LOSS_FORMAT		(1 << 6)	/* Malformed compressed frame */
+
+#define UVC_LOSS_RANGES		4
+
+/* Loss record of a completed frame, letting consumers decide whether to
+ * conceal the damage or drop the frame. Ranges are byte offsets in the
+ * frame where data went missing, with an upper bound of the missing length.
+ * Consecutive lost packets are merged in a single range, nranges keeps
+ * counting when the ranges array is full.
+ */
+struct uvc_buffer_loss {
+	u32 causes;
+	u16 lost_packets;
+	u16 nranges;
+	int usb_status;			/* Status of the last lost packet */
+	struct {
+		u32 offset;
+		u32 length;
+	} ranges[UVC_LOSS_RANGES];
+};
+
 struct uvc_buffer {
 //	struct vb2_v4l2_buffer buf;
 	struct list_head queue;
@@ -402,11 +592,53 @@ struct uvc_buffer {
 	unsigned int length;
 	unsigned int bytesused;
 
+	/* Sub-frame delivery. progress is published with release semantics
+	 * and must be read with smp_load_acquire().
+	 */
+	unsigned int progress;
+	unsigned int next_watermark;
+
+	struct uvc_buffer_loss loss;
+
+	/* The frame didn't change enough since the last delivered one, or
+	 * stands for the last good frame (UVC_LOSS_REPEATED), and only carries
+	 * metadata, bytesused is 0.
+	 */
+	unsigned int duplicate : 1;
+
 	u32 pts;
 };
 
 #define UVC_QUEUE_DISCONNECTED		(1 << 0)
-#define UVC_QUEUE_DROP_CORRUPTED	(1 << 1)
+
+/* Handling of corrupted frames, see uvc_queue_next_buffer(). */
+enum uvc_frame_policy {
+	UVC_FRAME_POLICY_DROP = 0,	/* Recycle the buffer in place */
+	UVC_FRAME_POLICY_DELIVER,	/* Complete the buffer with an error */
+	UVC_FRAME_POLICY_THRESHOLD,	/* Deliver if few packets were lost */
+	UVC_FRAME_POLICY_REPEAT,	/* Deliver the last good frame */
+};
+
+/* NAL units delivered in NAL streaming mode. The payload is stored without
+ * its start code in a chain of fixed-size chunks.
+ */
+struct uvc_nal_chunk {
+	struct list_head list;
+	unsigned int size;
+	__u8 data[UVC_NAL_CHUNK_SIZE];
+};
+
+struct uvc_nal {
+	struct list_head list;
+	struct list_head chunks;
+	unsigned int size;
+	unsigned int error;
+	unsigned int end_of_frame : 1;	/* Last NAL unit of the frame */
+	__u32 sequence;			/* Frame sequence number */
+	u64 timestamp;			/* Completion time in ns */
+};
+
+struct uvc_nal_queue;
 
 struct uvc_video_queue {
 //	struct vb2_queue queue;
@@ -415,8 +647,15 @@ struct uvc_video_queue {
 	unsigned int flags;
 	unsigned int buf_used;
 
+	/* Corrupted frames policy, can be changed while streaming. */
+	u32 policy;				/* enum uvc_frame_policy */
+	u32 loss_threshold;			/* Lost packets */
+
 	spinlock_t irqlock;			/* Protects irqqueue */
 	struct list_head irqqueue;
+	bool have_good;				/* A frame completed OK */
+
+	wait_queue_head_t progress_wait;	/* Buffer progress waiters */
 };
 
 struct uvc_video_chain {
@@ -479,6 +718,87 @@ struct uvc_stats_stream {
 };
 
 
+/* Stream recovery actions, by increasing cost. */
+enum uvc_recovery_action {
+	UVC_RECOVERY_RESYNC = 0,	/* Drop the frame and resync on FID */
+	UVC_RECOVERY_COMMIT,		/* Commit the streaming parameters */
+	UVC_RECOVERY_ALTSETTING,	/* Reset the alt setting and URBs */
+	UVC_RECOVERY_RESTART,		/* Full stream stop and start */
+	UVC_RECOVERY_NR_ACTIONS,
+};
+
+enum uvc_recovery_reason {
+	UVC_RECOVERY_REASON_EVENT = 0,	/* Stream error status event */
+	UVC_RECOVERY_REASON_ISO,	/* Sustained isochronous errors */
+	UVC_RECOVERY_REASON_URB,	/* Consecutive failed URBs */
+	UVC_RECOVERY_NR_REASONS,
+};
+
+/* Tracepoint reasons, see uvc_trace.h. */
+enum uvc_frame_end {
+	UVC_FRAME_END_FID = 0,		/* FID bit toggled */
+	UVC_FRAME_END_EOF,		/* EOF bit set */
+	UVC_FRAME_END_OVERFLOW,		/* Buffer size exceeded */
+	UVC_FRAME_END_SIZE,		/* Fixed frame size reached */
+};
+
+enum uvc_drop_reason {
+	UVC_DROP_SYNC = 0,		/* Waiting for a FID toggle */
+	UVC_DROP_LOST,			/* Isochronous packet error */
+};
+
+enum uvc_resync_reason {
+	UVC_RESYNC_START = 0,		/* First payload is mid-frame */
+	UVC_RESYNC_RECOVERY,		/* Requested by stream recovery */
+};
+
+enum uvc_urb_error {
+	UVC_URB_ERROR_PROTO = 0,	/* -EPROTO, bitstuff or unknown error */
+	UVC_URB_ERROR_ILSEQ,		/* -EILSEQ, CRC mismatch */
+	UVC_URB_ERROR_TIME,		/* -ETIME, no response */
+	UVC_URB_ERROR_OVERFLOW,		/* -EOVERFLOW, babble */
+	UVC_URB_ERROR_PIPE,		/* -EPIPE, endpoint stalled */
+	UVC_URB_ERROR_OTHER,		/* Any other completion error */
+	UVC_URB_ERROR_RESUBMIT,		/* usb_submit_urb() failed */
+	UVC_URB_NR_ERRORS,
+};
+
+/* Time to first frame of cold or warm starts, in microseconds. */
+struct uvc_ttff_stats {
+	unsigned int count;
+	u32 last_us;
+	u32 min_us;
+	u32 max_us;
+};
+
+enum uvc_start_phase {
+	UVC_START_CLOCK = 0,		/* Clock samples reset */
+	UVC_START_COMMIT,		/* Streaming parameters committed */
+	UVC_START_ALTSETTING,		/* Alternate setting selected */
+	UVC_START_URBS,			/* URBs and buffers allocated */
+	UVC_START_SUBMIT,		/* URBs submitted */
+	UVC_START_PAYLOAD,		/* First non-empty payload received */
+	UVC_START_SYNC,			/* First payload accepted in a buffer */
+	UVC_START_FRAME,		/* First frame complete */
+	UVC_START_NR_PHASES,
+};
+
+#define UVC_START_HISTORY	4
+
+/* Phase times of a stream start, in us relative to the start request.
+ * Phases that were skipped are left to 0.
+ */
+struct uvc_start_report {
+	u32 us[UVC_START_NR_PHASES];
+	unsigned int warm : 1;
+};
+
+struct uvc_recovery_stats {
+	unsigned int count;		/* Number of times the action ran */
+	struct timespec last_ts;	/* Time of the last run */
+	int last_result;		/* Result of the last run */
+};
+
 enum video_buf_type {
     VIDEO_BUF_TYPE_VIDEO_CAPTURE        = 1,
     VIDEO_BUF_TYPE_VIDEO_OUTPUT         = 2,
@@ -502,6 +822,27 @@ enum video_buf_type {
 
 
 
+struct uvc_streaming;
+
+typedef void (*uvc_decode_fn)(struct urb *urb, struct uvc_streaming *stream,
+			      struct uvc_buffer *buf);
+
+/* Transfer operations, see uvc_video.c. */
+struct uvc_video_ops {
+	enum video_buf_type type;
+	int xfer;				/* USB_ENDPOINT_XFER_* */
+	unsigned int sg : 1;			/* Needs scatter-gather support */
+	const uvc_decode_fn *variants;		/* Indexed by decode features */
+	uvc_decode_fn decode;			/* When there are no variants */
+	int (*init)(struct uvc_streaming *stream,
+		    struct usb_host_endpoint *ep, gfp_t gfp_flags);
+	void (*uninit)(struct uvc_streaming *stream, int free_buffers);
+	/* Submit idle URBs when output buffers are queued. URBs of ops that
+	 * implement it are not resubmitted by the completion handler.
+	 */
+	void (*kick)(struct uvc_streaming *stream);
+};
+
 struct uvc_streaming {
 	struct list_head list;
 	struct uvc_device *dev;
@@ -519,6 +860,10 @@ struct uvc_streaming {
 	unsigned int nformats;
 	struct uvc_format *format;
 
+	/* Lookup tables built by uvc_parse_streaming(). */
+	unsigned int nformat_index;
+	struct uvc_format **format_by_index;
+
 	struct uvc_streaming_control ctrl;
 	struct uvc_format *def_format;
 	struct uvc_format *cur_format;
@@ -531,9 +876,35 @@ struct uvc_streaming {
 
 	/* Buffers queue. */
 	unsigned int frozen : 1;
+	unsigned int streaming : 1;	/* Between enable and disable */
 	struct uvc_video_queue queue;
-	void (*decode) (struct urb *urb, struct uvc_streaming *video,
-			struct uvc_buffer *buf);
+	const struct uvc_video_ops *ops;
+	uvc_decode_fn decode;
+	void (*decode_data) (struct uvc_streaming *stream,
+			struct uvc_buffer *buf, const __u8 *data, int len);
+
+	/* Sub-frame delivery watermarks, in bytes or lines (0 to disable).
+	 * step is computed from the current frame when streaming starts.
+	 */
+	struct {
+		u32 bytes;
+		u32 lines;
+		unsigned int step;
+	} watermark;
+
+	/* NAL streaming mode, see uvc_nal.c. */
+	struct uvc_nal_queue *nal;
+	unsigned int nal_active : 1;
+
+	/* Static scene detection, see uvc_video.c. The reference signature
+	 * is the one of the last delivered frame.
+	 */
+	struct {
+		u32 threshold;			/* 0 to disable */
+		u32 skipped;
+		unsigned int valid : 1;
+		u32 sig[UVC_DEDUP_BLOCKS];
+	} dedup;
 
 	/* Context data used by the bulk completion handler. */
 	struct {
@@ -544,6 +915,52 @@ struct uvc_streaming {
 		__u32 max_payload_size;
 	} bulk;
 
+	/* Warm standby, see uvc_video.c. */
+	struct {
+		unsigned int ready : 1;		/* URBs are allocated */
+		__u8 altsetting;
+		__u32 payload_size;		/* URBs allocation parameters */
+		__u32 frame_size;
+	} standby;
+
+	/* Start timing, see uvc_video.c. */
+	struct {
+		u64 t0;				/* 0 once the first frame is in */
+		unsigned int pending : 1;	/* No payload received yet */
+		struct uvc_start_report cur;
+		struct uvc_start_report history[UVC_START_HISTORY];
+		unsigned int count;
+		unsigned int alt_skipped;	/* Redundant alt settings */
+		struct uvc_ttff_stats ttff[2];	/* Cold and warm starts */
+	} start;
+
+	/* Output pacing. */
+	struct {
+		struct hrtimer timer;
+		ktime_t period;
+		unsigned int active : 1;
+		spinlock_t lock;		/* Protects the fields below */
+		struct list_head pending;	/* Jitter buffer */
+		unsigned int count;
+		unsigned int released;
+		unsigned int late;
+		unsigned int early;
+		unsigned int stalls;
+	} pacing;
+
+	/* Context data used by the scatter-gather output handler. */
+	struct {
+		spinlock_t lock;		/* Serializes filling and submission */
+		unsigned int running : 1;
+		unsigned long idle;		/* Parked URBs bitmask */
+		struct scatterlist *sg[UVC_URBS];
+		__u8 *header[UVC_URBS];
+		struct uvc_buffer *buf[UVC_URBS];	/* Completed by the URB */
+		unsigned int nents;
+		unsigned int max_data;		/* Payload data per URB */
+		unsigned int offset;		/* In the buffer being encoded */
+	} sg_out;
+
 	struct urb *urb[UVC_URBS];
 	char *urb_buffer[UVC_URBS];
 	dma_addr_t urb_dma[UVC_URBS];
@@ -559,6 +976,35 @@ struct uvc_streaming {
 		struct uvc_stats_stream stream;
 	} stats;
 
+	/* Automatic stream recovery. */
+	struct {
+		struct work_struct work;
+		spinlock_t lock;		/* Protects pending, min_action, triggers */
+		unsigned int pending:1;		/* A recovery has been requested */
+		unsigned int min_action;	/* Cheapest action to consider */
+		unsigned int triggers[UVC_RECOVERY_NR_REASONS];
+		unsigned int iso_errors;	/* Consecutive bad isoc URBs */
+		unsigned int urb_errors;	/* Consecutive failed URBs */
+		atomic_t resync;		/* Resync at next completion */
+		bool resync_fid;		/* Resync at next payload header */
+
+		/* Accessed by the work handler only. */
+		unsigned int last_action;
+		unsigned long last_jiffies;
+		struct uvc_recovery_stats actions[UVC_RECOVERY_NR_ACTIONS];
+	} recovery;
+
+	/* URB error counters, summarized periodically in the kernel log. */
+	struct {
+		struct delayed_work work;
+		spinlock_t lock;		/* Protects the fields below */
+		unsigned int total[UVC_URB_NR_ERRORS];
+		unsigned int window[UVC_URB_NR_ERRORS];	/* Not reported yet */
+		unsigned int pending : 1;	/* Summary scheduled */
+		unsigned long last_report;	/* jiffies */
+		int last_status;
+	} urb_errors;
+
 	/* Timestamps support. */
 	struct uvc_clock {
 		struct uvc_clock_sample {
@@ -593,20 +1039,49 @@ struct uvc_device {
 
 	__u16 uvc_version;
 	__u32 clock_frequency;
+	__u32 desc_hash;		/* Raw descriptors hash, probe cache key */
+
+	/* Asynchronous probe */
+	struct completion probe_done;
+	u64 probe_start_ns;
+	u64 probe_sync_ns;
 
 	struct list_head entities;
 	struct list_head chains;
 
+	/* Controls indexed by entity ID and selector. Filled by
+	 * uvc_ctrl_init_device().
+	 */
+	DECLARE_HASHTABLE(ctrl_hash, 7);
+
 	/* Video Streaming interfaces */
 	struct list_head streams;
 	struct kref ref;
 
 	/* Status Interrupt Endpoint */
 	struct usb_host_endpoint *int_ep;
-	struct urb *int_urb;
+	struct urb *int_urb[UVC_STATUS_URBS];
 	__u8 *status;
+	spinlock_t status_lock;		/* Protects status_fifo writers */
+	DECLARE_KFIFO(status_fifo, struct uvc_status_packet,
+		      UVC_STATUS_FIFO_SIZE);
+	struct work_struct status_work;
 	struct input_dev *input;
 	char input_phys[64];
+
+	/* Asynchronous control writes */
+	struct {
+		struct work_struct work;
+		spinlock_t lock;		/* Protects pending and counters */
+		struct list_head pending;	/* Controls waiting for SET_CUR */
+		unsigned int nqueued;		/* Values queued by callers */
+		unsigned int nsent;		/* SET_CUR requests issued */
+		unsigned int nerrors;		/* SET_CUR requests failed */
+		unsigned int status_gen;	/* Bumped when status stops */
+	} async_ctrl;
+
+	/* Status events device */
+	struct uvc_events *events;
 };
 
 enum uvc_handle_state {
@@ -650,6 +1125,11 @@ extern unsigned int uvc_no_drop_param;
 extern unsigned int uvc_trace_param;
 extern unsigned int uvc_timeout_param;
 extern unsigned int uvc_hw_timestamps_param;
+extern unsigned int uvc_nal_param;
+extern unsigned int uvc_pacing_param;
+extern unsigned int uvc_standby_param;
+extern unsigned int uvc_fast_sync_param;
+extern unsigned int uvc_mjpeg_check_param;
 
 #define uvc_trace(flag, msg...) \
     do { \
@@ -674,9 +1154,31 @@ extern unsigned int uvc_hw_timestamps_param;
 extern struct uvc_driver uvc_driver;
 
 extern struct uvc_entity *uvc_entity_by_id(struct uvc_device *dev, int id);
+extern int uvc_probe_cache_get_ctrl(struct uvc_streaming *stream,
+		struct uvc_streaming_control *ctrl);
+extern void uvc_probe_cache_put_ctrl(struct uvc_streaming *stream,
+		const struct uvc_streaming_control *ctrl);
+extern size_t uvc_probe_report_dump(char *buf, size_t size);
+
+static inline struct uvc_format *
+uvc_format_by_index(const struct uvc_streaming *stream, __u8 index)
+{
+	return index < stream->nformat_index
+	     ? stream->format_by_index[index] : NULL;
+}
+
+static inline struct uvc_frame *
+uvc_frame_by_index(const struct uvc_format *format, __u8 index)
+{
+	return index < format->nframe_index
+	     ? format->frame_by_index[index] : NULL;
+}
 
 /* Video buffers queue management. */
 extern void uvc_queue_release(struct uvc_video_queue *queue);
+extern int uvc_queue_buffer(struct uvc_video_queue *queue,
+		struct uvc_buffer *buf);
+extern bool uvc_queue_empty(struct uvc_video_queue *queue);
 extern void uvc_queue_cancel(struct uvc_video_queue *queue, int disconnect);
 extern struct uvc_buffer *uvc_queue_next_buffer(struct uvc_video_queue *queue,
 		struct uvc_buffer *buf);
@@ -689,6 +1191,8 @@ extern unsigned long uvc_queue_get_unmapped_area(struct uvc_video_queue *queue,
 		unsigned long pgoff);
 #endif
 extern int uvc_queue_allocated(struct uvc_video_queue *queue);
+extern int uvc_queue_wait_progress(struct uvc_video_queue *queue,
+		struct uvc_buffer *buf, unsigned int bytes, long timeout);
 
 
 /* Video */
@@ -696,6 +1200,11 @@ extern int uvc_video_init(struct uvc_streaming *stream);
 extern int uvc_video_suspend(struct uvc_streaming *stream);
 extern int uvc_video_resume(struct uvc_streaming *stream, int reset);
 extern int uvc_video_enable(struct uvc_streaming *stream, int enable);
+extern void uvc_video_cleanup(struct uvc_streaming *stream);
+extern int uvc_video_queue_output(struct uvc_streaming *stream,
+		struct uvc_buffer *buf);
+extern void uvc_video_recover(struct uvc_streaming *stream,
+		enum uvc_recovery_reason reason);
 extern int uvc_probe_video(struct uvc_streaming *stream,
 		struct uvc_streaming_control *probe);
 extern int uvc_query_ctrl(struct uvc_device *dev, __u8 query, __u8 unit,
@@ -707,16 +1216,35 @@ extern void uvc_status_cleanup(struct uvc_device *dev);
 extern int uvc_status_start(struct uvc_device *dev, gfp_t flags);
 extern void uvc_status_stop(struct uvc_device *dev);
 
+/* Status events device */
+extern int uvc_events_init(void);
+extern void uvc_events_cleanup(void);
+extern int uvc_events_init_device(struct uvc_device *dev);
+extern void uvc_events_cleanup_device(struct uvc_device *dev);
+extern void uvc_events_queue(struct uvc_device *dev, const __u8 *data,
+		int len, u64 timestamp);
+
 /* Controls */
 
 
 extern int uvc_ctrl_add_mapping(struct uvc_video_chain *chain,
 		const struct uvc_control_mapping *mapping);
 extern int uvc_ctrl_init_device(struct uvc_device *dev);
+extern void uvc_ctrl_init_chain(struct uvc_video_chain *chain);
 extern void uvc_ctrl_cleanup_device(struct uvc_device *dev);
 extern int uvc_ctrl_restore_values(struct uvc_device *dev);
 
 extern int uvc_ctrl_begin(struct uvc_video_chain *chain);
+extern struct uvc_control *uvc_ctrl_find(struct uvc_device *dev,
+		__u8 entity_id, __u8 selector);
+extern int uvc_ctrl_set_async(struct uvc_device *dev, __u8 entity_id,
+		__u8 selector, const void *data, __u16 size);
+extern void uvc_ctrl_status_update(struct uvc_device *dev,
+		struct uvc_control *ctrl, const __u8 *data, int len);
+extern void uvc_ctrl_status_invalidate(struct uvc_device *dev);
+extern size_t uvc_ctrl_snapshot_size(struct uvc_video_chain *chain);
+extern ssize_t uvc_ctrl_snapshot(struct uvc_video_chain *chain, void *buf,
+		size_t size);
 
 
 extern int uvc_xu_ctrl_query(struct uvc_video_chain *chain,
@@ -730,6 +1258,17 @@ extern uint32_t uvc_fraction_to_interval(uint32_t numerator,
 extern struct usb_host_endpoint *uvc_find_endpoint(
 		struct usb_host_interface *alts, __u8 epaddr);
 
+/* NAL streaming */
+extern int uvc_nal_init(struct uvc_streaming *stream);
+extern void uvc_nal_cleanup(struct uvc_streaming *stream);
+extern bool uvc_nal_format(const struct uvc_format *format);
+extern void uvc_nal_start(struct uvc_streaming *stream);
+extern void uvc_nal_decode(struct urb *urb, struct uvc_streaming *stream);
+extern struct uvc_nal *uvc_nal_dequeue(struct uvc_streaming *stream,
+		long timeout);
+extern void uvc_nal_release(struct uvc_streaming *stream,
+		struct uvc_nal *nal);
+
 /* Quirks support */
 void uvc_video_decode_isight(struct urb *urb, struct uvc_streaming *stream,
 		struct uvc_buffer *buf);
@@ -742,5 +1281,15 @@ void uvc_debugfs_cleanup_stream(struct uvc_streaming *stream);
 
 size_t uvc_video_stats_dump(struct uvc_streaming *stream, char *buf,
 			    size_t size);
+size_t uvc_video_urb_errors_dump(struct uvc_streaming *stream, char *buf,
+				 size_t size);
+size_t uvc_video_recovery_dump(struct uvc_streaming *stream, char *buf,
+			       size_t size);
+size_t uvc_video_pacing_dump(struct uvc_streaming *stream, char *buf,
+			     size_t size);
+size_t uvc_video_start_dump(struct uvc_streaming *stream, char *buf,
+			    size_t size);
+size_t uvc_video_standby_dump(struct uvc_streaming *stream, char *buf,
+			      size_t size);
 
 #endif